@@ -23,7 +23,31 @@ along with Thoth Tutorial Chess. If not, see <http://www.gnu.org/licenses/>.
 #include <utility>
 #include <cmath>
 #include <cassert>
-#include <map>
+#include <cstdint>
+#include <array>
+#include <bit>
+#include <chrono>
+#include <type_traits>
+#include <algorithm>
+#include <cstdlib>
+#include <sstream>
+#include <fstream>
+#include <deque>
+#include <atomic>
+#include <memory>
+#include <new>
+#include <mutex>
+#include <thread>
+
+// The bit operations from <bit> need C++20, so build with -std=c++20
+// Parallel perft runs on std::thread, so build with -pthread
+// e.g. g++ -std=c++20 -O2 -pthread thoth_tut7.cpp
+// BMI2 PEXT slider attacks are compiled in on x86-64 and picked at startup only
+// if the CPU supports them. Build with -DNO_PEXT to leave them out entirely.
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__)) && !defined(NO_PEXT)
+#define USE_PEXT
+#include <immintrin.h>
+#endif
 
 #define INVALID -1
 #define BLANK 0
@@ -36,9 +60,18 @@ enum {
     BP, BN, BB, BR, BQ, BK
 };
 
+// Move flags, kept in the top four bits of a move
+// Bit 2 marks captures, bit 3 promotions and the low two bits give the promoted piece
 enum {
-    NO_CASTLE = 0, WHITE_QUEEN_SIDE_CASTLE, WHITE_KING_SIDE_CASTLE,
-    BLACK_QUEEN_SIDE_CASTLE, BLACK_KING_SIDE_CASTLE
+    QUIET = 0, DOUBLE_PAWN_PUSH, KING_CASTLE, QUEEN_CASTLE,
+    CAPTURE, EN_PASSANT,
+    KNIGHT_PROMOTION = 8, BISHOP_PROMOTION, ROOK_PROMOTION, QUEEN_PROMOTION,
+    KNIGHT_PROMOTION_CAPTURE, BISHOP_PROMOTION_CAPTURE, ROOK_PROMOTION_CAPTURE, QUEEN_PROMOTION_CAPTURE
+};
+
+// Castling rights, one bit each
+enum {
+    WHITE_K_CASTLE = 1, WHITE_Q_CASTLE = 2, BLACK_K_CASTLE = 4, BLACK_Q_CASTLE = 8
 };
 
 enum {
@@ -58,95 +91,416 @@ int init_pos[8][8] = {
 
 std::string enum_to_piece[13] = {"--", "WP", "WN", "WB", "WR", "WQ", "WK", "BP", "BN", "BB", "BR", "BQ", "BK"};
 
-std::map<std::pair<int, int>, std::string> square_to_string_map;
-std::map<std::string, std::pair<int, int>> string_to_square_map;
+// A bitboard is a set of squares, one bit per square
+// Square index = 8 * row + col, so a8 is 0 and h1 is 63, the same order as board[8][8]
+typedef uint64_t bitboard;
 
-void populate_square_move_maps() {
-    std::string letters[] = {"a", "b", "c", "d", "e", "f", "g", "h"};
-    std::string numbers[] = {"1", "2", "3", "4", "5", "6", "7", "8"};
-    
-    // Label the squares in the order in which we print them
-    // a8, b8, ...
-    // ...
-    // a1, b1, ...
-    // The variables i and j do the specify the rank/file 
-    // They only help with printing the board
-    for(int i = 0; i < 8; i++) {
-        for(int j = 0; j < 8; j++) {
-            std::pair<int, int> square = {i, j};
-            
-            int rank = 7 - i;
-            int file = j;
-            std::string file_name = letters[file];
-            std::string rank_name = numbers[rank];
-            std::string square_name = file_name + rank_name;
-
-            square_to_string_map.insert({square, square_name});
-            string_to_square_map.insert({square_name, square});
+#define SQUARE_BB(sq) (1ULL << (sq))
+#define DARK_SQUARES 0x55AA55AA55AA55AAULL
+#define FILE_A 0x0101010101010101ULL
+#define FILE_H 0x8080808080808080ULL
+
+constexpr int square_index(int row, int col) {
+    return 8 * row + col;
+}
+
+// Index of the lowest set square
+inline int lsb(bitboard b) {
+    return std::countr_zero(b);
+}
+
+// Return the lowest set square and remove it from the set
+inline int pop_lsb(bitboard &b) {
+    int sq = std::countr_zero(b);
+    b &= b - 1;
+    return sq;
+}
+
+constexpr int popcount(bitboard b) {
+    return std::popcount(b);
+}
+
+// Square names in the order of the square index, a8, b8, ..., h1
+constexpr const char *square_names[64] = {
+    "a8", "b8", "c8", "d8", "e8", "f8", "g8", "h8",
+    "a7", "b7", "c7", "d7", "e7", "f7", "g7", "h7",
+    "a6", "b6", "c6", "d6", "e6", "f6", "g6", "h6",
+    "a5", "b5", "c5", "d5", "e5", "f5", "g5", "h5",
+    "a4", "b4", "c4", "d4", "e4", "f4", "g4", "h4",
+    "a3", "b3", "c3", "d3", "e3", "f3", "g3", "h3",
+    "a2", "b2", "c2", "d2", "e2", "f2", "g2", "h2",
+    "a1", "b1", "c1", "d1", "e1", "f1", "g1", "h1"
+};
+
+// A 10x12 mailbox: the board with a column of off board squares on each side and two
+// rows above and below, so that a single knight or king step from any square stays inside it.
+// Directions become a single index addition, and the border stops every walk by itself.
+constexpr int to_mailbox(int sq) {
+    return 10 * (sq / 8 + 2) + sq % 8 + 1;
+}
+
+// The board square of each mailbox square, INVALID on the border
+constexpr std::array<int, 120> make_mailbox_squares() {
+    std::array<int, 120> squares{};
+    for(int m = 0; m < 120; m++) {
+        squares[m] = INVALID;
+    }
+    for(int sq = 0; sq < 64; sq++) {
+        squares[to_mailbox(sq)] = sq;
+    }
+    return squares;
+}
+
+constexpr std::array<int, 120> mailbox_squares = make_mailbox_squares();
+
+// All the tables below which only depend on the geometry of the board are worked out
+// by the compiler, so they cost nothing at startup
+constexpr int knight_directions[8] = {-21, -19, -12, -8, 8, 12, 19, 21};
+constexpr int king_directions[8] = {-11, -10, -9, -1, 1, 9, 10, 11};
+constexpr int bishop_directions[4] = {-11, -9, 9, 11};
+constexpr int rook_directions[4] = {-10, -1, 1, 10};
+
+// Attack sets of a piece which jumps straight to its target squares
+constexpr std::array<bitboard, 64> leaper_attacks(const int (&directions)[8]) {
+    std::array<bitboard, 64> attacks{};
+    for(int sq = 0; sq < 64; sq++) {
+        for(int direction : directions) {
+            int target = mailbox_squares[to_mailbox(sq) + direction];
+            if(target != INVALID) {
+                attacks[sq] |= SQUARE_BB(target);
+            }
         }
     }
+    return attacks;
 }
 
+// White pawns move towards row 0 and black pawns towards row 7
+constexpr std::array<std::array<bitboard, 64>, 3> make_pawn_attacks() {
+    std::array<std::array<bitboard, 64>, 3> attacks{};
+    for(int sq = 0; sq < 64; sq++) {
+        for(int direction : {9, 11}) {
+            int white_target = mailbox_squares[to_mailbox(sq) - direction];
+            int black_target = mailbox_squares[to_mailbox(sq) + direction];
+            if(white_target != INVALID) {
+                attacks[WHITE][sq] |= SQUARE_BB(white_target);
+            }
+            if(black_target != INVALID) {
+                attacks[BLACK][sq] |= SQUARE_BB(black_target);
+            }
+        }
+    }
+    return attacks;
+}
+
+constexpr std::array<bitboard, 64> knight_attacks = leaper_attacks(knight_directions);
+constexpr std::array<bitboard, 64> king_attacks = leaper_attacks(king_directions);
+constexpr std::array<std::array<bitboard, 64>, 3> pawn_attacks = make_pawn_attacks();   // Indexed by the side of the pawn
+
+// Walk the rays from a square until the edge of the board or the first occupied square
+// The blocking square is included, it may be a capture
+// Too slow for move generation, it is only used to fill the tables below
+constexpr bitboard slider_attacks(int sq, bitboard occupied, const int directions[4]) {
+    bitboard attacks = 0;
+    for(int d = 0; d < 4; d++) {
+        int m = to_mailbox(sq) + directions[d];
+        while(mailbox_squares[m] != INVALID) {
+            bitboard target = SQUARE_BB(mailbox_squares[m]);
+            attacks |= target;
+            if(occupied & target) {
+                break;
+            }
+            m += directions[d];
+        }
+    }
+    return attacks;
+}
+
+// The rook or bishop directions joining two squares, nullptr if they are not aligned
+constexpr const int *aligned_directions(int a, int b) {
+    if(slider_attacks(a, 0, rook_directions) & SQUARE_BB(b)) {
+        return rook_directions;
+    }
+    if(slider_attacks(a, 0, bishop_directions) & SQUARE_BB(b)) {
+        return bishop_directions;
+    }
+    return nullptr;
+}
+
+constexpr std::array<std::array<bitboard, 64>, 64> make_between_table() {
+    std::array<std::array<bitboard, 64>, 64> between{};
+    for(int a = 0; a < 64; a++) {
+        for(int b = 0; b < 64; b++) {
+            const int *directions = aligned_directions(a, b);
+            if(a != b && directions != nullptr) {
+                between[a][b] = slider_attacks(a, SQUARE_BB(b), directions) & slider_attacks(b, SQUARE_BB(a), directions);
+            }
+        }
+    }
+    return between;
+}
+
+constexpr std::array<std::array<bitboard, 64>, 64> make_line_table() {
+    std::array<std::array<bitboard, 64>, 64> line{};
+    for(int a = 0; a < 64; a++) {
+        for(int b = 0; b < 64; b++) {
+            const int *directions = aligned_directions(a, b);
+            if(a != b && directions != nullptr) {
+                line[a][b] = (slider_attacks(a, 0, directions) & slider_attacks(b, 0, directions)) | SQUARE_BB(a) | SQUARE_BB(b);
+            }
+        }
+    }
+    return line;
+}
+
+// between_bb[a][b] holds the squares strictly between a and b, and line_bb[a][b] the whole
+// rank, file or diagonal through both, when the two squares are aligned. Both are empty otherwise.
+constexpr std::array<std::array<bitboard, 64>, 64> between_bb = make_between_table();
+constexpr std::array<std::array<bitboard, 64>, 64> line_bb = make_line_table();
+
+// Magic multipliers for the rook and bishop attack tables. Each one maps every subset of
+// the relevant occupancy of its square to a distinct table slot, or to a slot that holds
+// the same attack set. They were found by trial with sparse random numbers.
+const bitboard rook_magic_numbers[64] = {
+    0x1080004008801020ULL, 0x0840092002c03000ULL, 0x1900200010400900ULL, 0x0880100008000480ULL,
+    0x4200100420080200ULL, 0x8100020100080400ULL, 0x0200040110886200ULL, 0x0200008040220411ULL,
+    0x0404800084400220ULL, 0x0000401000402000ULL, 0x0086001081220440ULL, 0x0408800800100280ULL,
+    0x000a001201040820ULL, 0x8848800200840080ULL, 0x4001000100040200ULL, 0x0442000102105084ULL,
+    0x9080010020804100ULL, 0x0040404000201009ULL, 0x0000808010002009ULL, 0x2200090021d00100ULL,
+    0x0008008008040080ULL, 0x0004004002010040ULL, 0x0011040008015042ULL, 0x00000a0001768104ULL,
+    0x0000800080204009ULL, 0x2010004140002001ULL, 0x9800200280100080ULL, 0x1000100080080080ULL,
+    0x0442000a00049020ULL, 0x2100040080020080ULL, 0x0800120400900148ULL, 0x0010040a00128541ULL,
+    0x2800804000800030ULL, 0x1010002000400041ULL, 0x4000200011004100ULL, 0x0610008410800800ULL,
+    0x0400802402800800ULL, 0xc100020080800400ULL, 0x0002000802000401ULL, 0x0182085882000401ULL,
+    0x0220204000808000ULL, 0x2860100040024022ULL, 0x0001002004110040ULL, 0x99101042000a0020ULL,
+    0x0004080004008080ULL, 0x0010040002008080ULL, 0x2012004881020004ULL, 0x8300842444820011ULL,
+    0x0088403882010200ULL, 0x0820400080210100ULL, 0x0110910040a00300ULL, 0x0801100280080480ULL,
+    0x0242009008200600ULL, 0x1002000489500200ULL, 0x0040800200010080ULL, 0x0091800041000080ULL,
+    0x0000209300488001ULL, 0x04c1002414824001ULL, 0x020020000b001041ULL, 0x7000100004200901ULL,
+    0x8002002004100802ULL, 0x30010002084c0007ULL, 0x0888221800813004ULL, 0x4000002840840112ULL
+};
+
+const bitboard bishop_magic_numbers[64] = {
+    0xa010041108003100ULL, 0x006082020a002900ULL, 0x6810010619200000ULL, 0x08281a0520000408ULL,
+    0x0001104001000400ULL, 0x0018901008048400ULL, 0x00040a0210245280ULL, 0x000200210808a402ULL,
+    0x9140048410821200ULL, 0x0800091010820041ULL, 0x20504804832202c0ULL, 0x0100091401081000ULL,
+    0x8021011140000012ULL, 0x0810020804450400ULL, 0x208b0542109008a2ULL, 0x0080084a08040204ULL,
+    0x0040e2a80811244cULL, 0x2505022008008108ULL, 0x0430220100420040ULL, 0x010a040420220040ULL,
+    0x1105000290400000ULL, 0x0093001200822120ULL, 0x4000a62048043004ULL, 0x280120048a015004ULL,
+    0x006090002a020814ULL, 0x44042000240800d0ULL, 0x01102800040a4400ULL, 0x1004080080220040ULL,
+    0x0001001011004024ULL, 0x0010044000805040ULL, 0x0914041200820100ULL, 0x0004821012821480ULL,
+    0x0024040500c05021ULL, 0x0088611002080200ULL, 0x0116080a00040020ULL, 0x4000020080080080ULL,
+    0x2450450140840040ULL, 0x0000880201484100ULL, 0x0222020404020092ULL, 0x8081110600002e00ULL,
+    0x2842101105000801ULL, 0x1100809008001025ULL, 0x00020202221c0400ULL, 0x0422014022009020ULL,
+    0x0210046102100c00ULL, 0xc004008082029102ULL, 0x00aa461801101200ULL, 0x0404080080201108ULL,
+    0x020542108c205002ULL, 0x0410544804100100ULL, 0x0040910841100000ULL, 0x0400200042021100ULL,
+    0x00004204850400c0ULL, 0x0200100410a42102ULL, 0x1040020801210102ULL, 0x0805040410420000ULL,
+    0x2884804130100200ULL, 0x800c262201242000ULL, 0x1058000194108800ULL, 0x0014221054420204ULL,
+    0x0104000012a02200ULL, 0x0200881003300100ULL, 0x0140400202840100ULL, 0x0402020801010201ULL
+};
+
+struct magic {
+    bitboard mask;      // Squares whose occupancy changes the attack set, the edges are left out
+    bitboard number;
+    bitboard *attacks;  // This square's slice of the shared table
+    int shift;
+
+    unsigned index(bitboard occupied) const {
+        return unsigned(((occupied & mask) * number) >> shift);
+    }
+};
+
+magic rook_magics[64];
+magic bishop_magics[64];
+bitboard rook_table[102400];
+bitboard bishop_table[5248];
+
+enum {
+    MAGIC_BACKEND, PEXT_BACKEND
+};
+
+int slider_backend = MAGIC_BACKEND;
+
+#ifdef USE_PEXT
+// PEXT gathers the occupancy bits under the mask into a dense index, so no multiplier is needed
+__attribute__((target("bmi2"))) unsigned pext_index(bitboard occupied, bitboard mask) {
+    return unsigned(_pext_u64(occupied, mask));
+}
+#endif
+
+// Fill the attack table of every square for every subset of its relevant occupancy
+// The slots are laid out for the backend chosen in init_slider_attacks()
+void init_magics(magic magics[64], const bitboard magic_numbers[64], bitboard table[],
+                 const int directions[4]) {
+    bitboard *next_slot = table;
+    for(int sq = 0; sq < 64; sq++) {
+        int i = sq / 8;
+        int j = sq % 8;
+
+        // The last square of a ray is attacked whether it is occupied or not
+        bitboard edges = ((0xFFULL | 0xFFULL << 56) & ~(0xFFULL << (8 * i)))
+                       | ((FILE_A | FILE_H) & ~(FILE_A << j));
+
+        magic &m = magics[sq];
+        m.mask = slider_attacks(sq, 0, directions) & ~edges;
+        m.number = magic_numbers[sq];
+        m.shift = 64 - popcount(m.mask);
+        m.attacks = next_slot;
+        next_slot += 1ULL << popcount(m.mask);
+
+        // Enumerate all subsets of the mask with the Carry-Rippler trick
+        bitboard subset = 0;
+        do {
+            unsigned slot = m.index(subset);
+#ifdef USE_PEXT
+            if(slider_backend == PEXT_BACKEND) {
+                slot = pext_index(subset, m.mask);
+            }
+#endif
+            m.attacks[slot] = slider_attacks(sq, subset, directions);
+            subset = (subset - m.mask) & m.mask;
+        } while(subset);
+    }
+}
+
+bitboard magic_bishop_attacks(int sq, bitboard occupied) {
+    const magic &m = bishop_magics[sq];
+    return m.attacks[m.index(occupied)];
+}
+
+bitboard magic_rook_attacks(int sq, bitboard occupied) {
+    const magic &m = rook_magics[sq];
+    return m.attacks[m.index(occupied)];
+}
+
+#ifdef USE_PEXT
+__attribute__((target("bmi2"))) bitboard pext_bishop_attacks(int sq, bitboard occupied) {
+    const magic &m = bishop_magics[sq];
+    return m.attacks[_pext_u64(occupied, m.mask)];
+}
+
+__attribute__((target("bmi2"))) bitboard pext_rook_attacks(int sq, bitboard occupied) {
+    const magic &m = rook_magics[sq];
+    return m.attacks[_pext_u64(occupied, m.mask)];
+}
+#endif
+
+// Slider attack lookups, pointed at the fastest backend this CPU supports
+bitboard (*bishop_attacks)(int sq, bitboard occupied) = magic_bishop_attacks;
+bitboard (*rook_attacks)(int sq, bitboard occupied) = magic_rook_attacks;
+
+void init_slider_attacks() {
+#ifdef USE_PEXT
+    if(__builtin_cpu_supports("bmi2")) {
+        slider_backend = PEXT_BACKEND;
+        bishop_attacks = pext_bishop_attacks;
+        rook_attacks = pext_rook_attacks;
+    }
+#endif
+    init_magics(rook_magics, rook_magic_numbers, rook_table, rook_directions);
+    init_magics(bishop_magics, bishop_magic_numbers, bishop_table, bishop_directions);
+}
+
+std::string slider_backend_name() {
+    return slider_backend == PEXT_BACKEND ? "BMI2 PEXT" : "magic multiplication";
+}
+
+// Zobrist keys: a random number for every piece on every square, for the side to play,
+// for every set of castling rights and for the file of the en passant pawn. The key of a
+// position is the XOR of the numbers of everything in it, so a move updates it with a few XORs.
+struct zobrist_keys {
+    uint64_t pieces[13][64];
+    uint64_t side;
+    uint64_t castling[16];
+    uint64_t en_passant[8];
+};
+
+// xorshift64* generator with a fixed seed, so the keys are the same in every build
+constexpr uint64_t random_u64(uint64_t &state) {
+    state ^= state >> 12;
+    state ^= state << 25;
+    state ^= state >> 27;
+    return state * 2685821657736338717ULL;
+}
+
+constexpr zobrist_keys make_zobrist_keys() {
+    zobrist_keys keys{};
+    uint64_t state = 1070372;
+    for(int piece = WP; piece <= BK; piece++) {
+        for(int sq = 0; sq < 64; sq++) {
+            keys.pieces[piece][sq] = random_u64(state);
+        }
+    }
+    keys.side = random_u64(state);
+    for(int rights = 0; rights < 16; rights++) {
+        keys.castling[rights] = random_u64(state);
+    }
+    for(int col = 0; col < 8; col++) {
+        keys.en_passant[col] = random_u64(state);
+    }
+    return keys;
+}
+
+constexpr zobrist_keys zobrist = make_zobrist_keys();
+constexpr auto &zobrist_pieces = zobrist.pieces;
+constexpr const uint64_t &zobrist_side = zobrist.side;
+constexpr auto &zobrist_castling = zobrist.castling;
+constexpr auto &zobrist_en_passant = zobrist.en_passant;
+
+// A move packed into 16 bits: from square, to square and a flag
+// The captured piece and the state needed to take the move back live in an undo_record
 class move {
 public:
-    std::pair<int, int> init_pos;
-    std::pair<int, int> final_pos;
-    int captured_piece;
-    int promoted_piece;
-    int castle_code;
-    bool do_enpassant;
-
-    move(std::pair<int, int> init_pos, std::pair<int, int> final_pos, int captured_piece, int promoted_piece) {
-        this->init_pos = init_pos;
-        this->final_pos = final_pos;
-        this->captured_piece = captured_piece;
-        this->promoted_piece = promoted_piece;
-        this->castle_code = NO_CASTLE;
-        this->do_enpassant = false;
-    }
-
-    move(std::pair<int, int> init_pos, std::pair<int, int> final_pos, int captured_piece) {
-        this->init_pos = init_pos;
-        this->final_pos = final_pos;
-        this->captured_piece = captured_piece;
-        this->promoted_piece = BL;
-        this->castle_code = NO_CASTLE;
-        this->do_enpassant = false;
-    }
-
-    move(std::pair<int, int> init_pos, std::pair<int, int> final_pos) {
-        this->init_pos = init_pos;
-        this->final_pos = final_pos;
-        this->captured_piece = BL;
-        this->promoted_piece = BL;
-        this->castle_code = NO_CASTLE;
-        this->do_enpassant = false;
-    }
-
-    move(int castle_code) {
-        this->castle_code = castle_code;
-        this->init_pos = {INVALID, INVALID};
-        this->final_pos = {INVALID, INVALID};
-        this->captured_piece = BL;
-        this->promoted_piece = BL;
-        this->do_enpassant = false;
-    }
-
-    move(bool do_enpassant, std::pair<int, int> init_pos, std::pair<int, int> final_pos, int captured_piece) {
-        this->do_enpassant = true;
-        this->init_pos = init_pos;
-        this->final_pos = final_pos;
-        this->captured_piece = captured_piece;
-        this->promoted_piece = BL;
-        this->castle_code = NO_CASTLE;
+    uint16_t data;
+
+    // Left uninitialised so that a move_list costs nothing to create, use NULL_MOVE for an empty move
+    move() = default;
+
+    move(int from, int to, int flag) {
+        this->data = uint16_t(from | (to << 6) | (flag << 12));
     }
-    
+
+    int from() const {
+        return data & 63;
+    }
+
+    int to() const {
+        return (data >> 6) & 63;
+    }
+
+    int flag() const {
+        return data >> 12;
+    }
+
+    bool is_capture() const {
+        return flag() & CAPTURE;
+    }
+
+    bool is_promotion() const {
+        return flag() & KNIGHT_PROMOTION;
+    }
+
+    bool is_castle() const {
+        return flag() == KING_CASTLE || flag() == QUEEN_CASTLE;
+    }
+
+    // The piece the pawn turns into, WN, WB, WR and WQ are consecutive and so are BN, BB, BR and BQ
+    int promoted_piece(int side) const {
+        return (side == WHITE ? WN : BN) + (flag() & 3);
+    }
+
+    bool operator==(const move &other) const {
+        return data == other.data;
+    }
+
     std::string get_move_string() {
         std::string move_string;
-        if(castle_code == NO_CASTLE) {
-            move_string = square_to_string_map[init_pos] + square_to_string_map[final_pos];
+        if(!is_castle()) {
+            move_string = std::string(square_names[from()]) + square_names[to()];
+            if(is_promotion()) {
+                move_string += "nbrq"[flag() & 3];
+            }
         } else {
-            if(castle_code == WHITE_KING_SIDE_CASTLE || BLACK_KING_SIDE_CASTLE) {
+            if(flag() == KING_CASTLE) {
                 move_string = "0-0";
             } else {
                 move_string = "0-0-0";
@@ -156,788 +510,1316 @@ public:
     }
 };
 
-class chessboard {
-private:
-    int board[8][8];
-    int side_to_play;
+static_assert(sizeof(move) == 2, "a move must fit in 16 bits");
 
-    bool whiteQcastle, prevWhiteQcastle;
-    bool whiteKcastle, prevWhiteKcastle;
-    bool blackQcastle, prevBlackQcastle;
-    bool blackKcastle, prevBlackKcastle;
+const move NULL_MOVE(0, 0, QUIET);
 
-    bool is_en_passant_allowed, prev_is_en_passant_allowed;
-    std::pair<int, int> en_passant_square, prev_en_passant_square;
-    
-    std::vector<int> fifty_move_history;
+// No legal chess position has more than 218 moves
+#define MAX_MOVES 256
+
+// A fixed capacity list of moves that lives on the stack, so generating moves never allocates
+struct move_list {
+    move moves[MAX_MOVES];
+    int count = 0;
 
-    int get_piece_side(int piece) {
-        if(piece == BL) return BLANK;
-        if(piece <= WK) return WHITE;
-        return BLACK;
+    void push_back(move m) {
+        moves[count++] = m;
     }
 
-    int opposite_side() {
-        return side_to_play == WHITE ? BLACK : WHITE;
+    // A move from one square to each target, capturing on the enemy squares
+    void add_moves(int from, bitboard targets, bitboard enemies) {
+        while(targets) {
+            int to = pop_lsb(targets);
+            push_back(move(from, to, (enemies & SQUARE_BB(to)) ? CAPTURE : QUIET));
+        }
+    }
+
+    int size() const {
+        return count;
+    }
+
+    bool empty() const {
+        return count == 0;
+    }
+
+    move &operator[](int index) {
+        return moves[index];
+    }
+
+    move *begin() {
+        return moves;
+    }
+
+    move *end() {
+        return moves + count;
     }
+};
+
+// Takes the place of a move_list when only the number of moves is wanted. The generator
+// is written for either, and the moves to the targets of a piece are counted with one popcount.
+struct move_counter {
+    int count = 0;
 
-    bool is_square_in_range(int row, int col) {
-        return (row < 8 && row >= 0 && col < 8 && col >= 0);
+    void push_back(move) {
+        count++;
     }
 
-    bool is_slider(int piece) {
-        return piece == WQ || piece == BQ || piece == WR || piece == BR || piece == WB || piece == BB;
+    void add_moves(int, bitboard targets, bitboard) {
+        count += popcount(targets);
+    }
+};
+
+// Which moves the generator produces. Promotions go with the captures, as both change the material.
+enum {CAPTURE_MOVES, QUIET_MOVES, ALL_MOVES};
+
+// Everything make_move overwrites which cannot be worked out again from the move itself
+struct undo_record {
+    uint64_t key;
+    uint8_t castling;
+    int8_t en_passant_square;
+    uint8_t captured_piece;
+    uint16_t fifty_move_count;
+};
+
+// Room in the undo stack for a long game plus search, it grows if a game goes past it
+#define MAX_PLY 2048
+
+// Build with -DCOPY_MAKE to make the children of a position by copying it and playing the
+// move on the copy, instead of playing the move and taking it back with undo_move
+#ifdef COPY_MAKE
+#define POSITION_UPDATE_NAME "copy-make"
+#else
+#define POSITION_UPDATE_NAME "make/unmake"
+#endif
+
+// Build with -DMAILBOX to keep a 10x12 mailbox of pieces next to the piece sets. Finding the piece
+// on a square is then a single load instead of a search of the sets, at the cost of a position
+// twice the size, which copy-make pays for on every move.
+#ifdef MAILBOX
+#define BOARD_LAYOUT_NAME "bitboards and 10x12 mailbox"
+#define OFFBOARD 0xFF
+#else
+#define BOARD_LAYOUT_NAME "bitboards"
+#endif
+
+// What gives_check needs to know about a position, worked out once for all of its moves
+struct check_info {
+    // Squares from which each kind of our pieces attacks the enemy king, indexed like kinds
+    bitboard check_squares[6];
+    // Our pieces which uncover a check by one of our sliders when they leave its line
+    bitboard discovery_candidates;
+    int enemy_king;
+};
+
+// The complete state of a position in two cache lines. The nine piece sets take the first
+// 72 bytes and the side to play, castling rights, en passant square, fifty move count, key and
+// king squares follow them. The mailbox, when there is one, adds two more lines.
+// It holds no pointers or containers, so a child position can be made with a plain copy.
+struct alignas(64) position {
+    // One set per piece type, indexed by the white piece minus WP, shared by both sides
+    bitboard kinds[6];
+    // The pieces of each side, occupancy[BLANK] holds the pieces of both
+    bitboard occupancy[3];
+
+    uint8_t side_to_play;
+    // Castling rights as a bitmask of WHITE_K_CASTLE, WHITE_Q_CASTLE, ...
+    uint8_t castling;
+    // Square of the pawn which has just moved two squares ahead, INVALID otherwise
+    int8_t en_passant_square;
+    // Half moves since the last capture or pawn move, for the fifty move rule
+    uint16_t fifty_move_count;
+
+    // Zobrist key, kept up to date by make_move
+    uint64_t key;
+
+    // Square of each side's king, kept up to date by put_piece. The piece sets above already
+    // list the squares of every other piece, so those are never searched for either.
+    int8_t king_square[3];
+
+#ifdef MAILBOX
+    // The piece on every square of the 10x12 mailbox, OFFBOARD on the border
+    uint8_t mailbox[120];
+#endif
+
+    int get_piece_side(int piece) const {
+        static const int piece_sides[13] = {BLANK, WHITE, WHITE, WHITE, WHITE, WHITE, WHITE,
+                                            BLACK, BLACK, BLACK, BLACK, BLACK, BLACK};
+        return piece_sides[piece];
+    }
+
+    int opposite_side() const {
+        return side_to_play == WHITE ? BLACK : WHITE;
     }
 
-    bool is_diagonal_attacker(int piece) {
+    bool is_diagonal_attacker(int piece) const {
         return piece == WQ || piece == BQ || piece == WB || piece == BB;
     }
 
-    bool is_straight_attacker(int piece) {
+    bool is_straight_attacker(int piece) const {
         return piece == WQ || piece == BQ || piece == WR || piece == BR;
     }
     
-    bool is_knight(int piece) {
+    bool is_knight(int piece) const {
         return piece == WN || piece == BN;
     }
     
-    bool is_pawn(int piece) {
+    bool is_pawn(int piece) const {
         return piece == WP || piece == BP;
     }
     
-    bool is_king(int piece) {
+    bool is_king(int piece) const {
         return piece == WK || piece == BK;
     }
-    
-    bool is_bishop(int piece) {
-        return piece == WB || piece == BB;
+
+    // WP...WK and BP...BK map to the same six kinds
+    int piece_kind(int piece) const {
+        static const int piece_kinds[13] = {0, 0, 1, 2, 3, 4, 5, 0, 1, 2, 3, 4, 5};
+        return piece_kinds[piece];
     }
-public:
-    chessboard() {
-        init();
+
+    bitboard pieces(int piece) const {
+        return kinds[piece_kind(piece)] & occupancy[get_piece_side(piece)];
     }
 
-    void init() {
-        for(int i = 0; i < 8; i++) {
-            for(int j = 0; j < 8; j++) {
-                board[i][j] = init_pos[i][j];
-            }
+    int piece_on(int sq) const {
+#ifdef MAILBOX
+        return mailbox[to_mailbox(sq)];
+#else
+        bitboard b = SQUARE_BB(sq);
+        if(!(occupancy[BLANK] & b)) {
+            return BL;
         }
-        whiteQcastle = whiteKcastle = true;
-        blackQcastle = blackKcastle = true;
-        is_en_passant_allowed = true;
-        en_passant_square = {INVALID, INVALID};
-        fifty_move_history.push_back(0);
-        side_to_play = WHITE;
+        int kind = 0;
+        while(!(kinds[kind] & b)) {
+            kind++;
+        }
+        return ((occupancy[WHITE] & b) ? WP : BP) + kind;
+#endif
     }
 
-    void print() {
-        for(int i = 0; i < 8; i++) {
-            for(int j = 0; j < 8; j++) {
-                std::cout << enum_to_piece[board[i][j]] << " ";
+    // The only two functions which write to the piece sets, so that they always stay in sync
+    void put_piece(int sq, int piece) {
+        kinds[piece_kind(piece)] |= SQUARE_BB(sq);
+        occupancy[get_piece_side(piece)] |= SQUARE_BB(sq);
+        occupancy[BLANK] |= SQUARE_BB(sq);
+        if(is_king(piece)) {
+            king_square[get_piece_side(piece)] = sq;
+        }
+#ifdef MAILBOX
+        mailbox[to_mailbox(sq)] = piece;
+#endif
+    }
+
+    void remove_piece(int sq, int piece) {
+        kinds[piece_kind(piece)] &= ~SQUARE_BB(sq);
+        occupancy[get_piece_side(piece)] &= ~SQUARE_BB(sq);
+        occupancy[BLANK] &= ~SQUARE_BB(sq);
+#ifdef MAILBOX
+        mailbox[to_mailbox(sq)] = BL;
+#endif
+    }
+
+    // Squares attacked by a non pawn piece standing on sq
+    bitboard piece_attacks(int piece, int sq, bitboard occupied) const {
+        bitboard attacks = 0;
+        if(is_knight(piece)) {
+            attacks = knight_attacks[sq];
+        } else if(is_king(piece)) {
+            attacks = king_attacks[sq];
+        }
+        if(is_diagonal_attacker(piece)) {
+            attacks |= bishop_attacks(sq, occupied);
+        }
+        if(is_straight_attacker(piece)) {
+            attacks |= rook_attacks(sq, occupied);
+        }
+        return attacks;
+    }
+
+    // Build the key from scratch, make_move keeps it up to date after that
+    uint64_t compute_key() const {
+        uint64_t new_key = 0;
+        for(int sq = 0; sq < 64; sq++) {
+            if(piece_on(sq) != BL) {
+                new_key ^= zobrist_pieces[piece_on(sq)][sq];
             }
-            std::cout << std::endl;
         }
+        new_key ^= zobrist_castling[castling];
+        if(en_passant_square != INVALID) {
+            new_key ^= zobrist_en_passant[en_passant_square % 8];
+        }
+        if(side_to_play == BLACK) {
+            new_key ^= zobrist_side;
+        }
+        return new_key;
+    }
 
-        std::cout << std::endl;
-        std::cout << "Side to play: " << (side_to_play == WHITE ? "WHITE" : "BLACK") << "\n\n";
+    // Lose the castling rights if a rook or king leaves or a rook is captured on its initial square
+    void update_castle_permissions(int sq) {
+        if(sq == square_index(7, 4)) castling &= ~(WHITE_K_CASTLE | WHITE_Q_CASTLE);
+        if(sq == square_index(7, 7)) castling &= ~WHITE_K_CASTLE;
+        if(sq == square_index(7, 0)) castling &= ~WHITE_Q_CASTLE;
+        if(sq == square_index(0, 4)) castling &= ~(BLACK_K_CASTLE | BLACK_Q_CASTLE);
+        if(sq == square_index(0, 7)) castling &= ~BLACK_K_CASTLE;
+        if(sq == square_index(0, 0)) castling &= ~BLACK_Q_CASTLE;
     }
-    
-    int get_curr_side() {
-        return side_to_play;
+
+    // Take every piece off the board
+    void clear() {
+        for(int kind = 0; kind < 6; kind++) {
+            kinds[kind] = 0;
+        }
+        occupancy[BLANK] = occupancy[WHITE] = occupancy[BLACK] = 0;
+        king_square[BLANK] = king_square[WHITE] = king_square[BLACK] = INVALID;
+#ifdef MAILBOX
+        for(int m = 0; m < 120; m++) {
+            mailbox[m] = (mailbox_squares[m] == INVALID ? OFFBOARD : BL);
+        }
+#endif
     }
 
-    void make_move(move m) {
-        int curr_piece = board[m.init_pos.first][m.init_pos.second];
-        // Store the current castling permissions
-        prevWhiteKcastle = whiteKcastle;
-        prevWhiteQcastle = whiteQcastle;
-        prevBlackKcastle = blackKcastle;
-        prevBlackQcastle = blackQcastle;
-
-        // Store the current en_passant permissions
-        prev_en_passant_square = en_passant_square;
-        prev_is_en_passant_allowed = is_en_passant_allowed;
-
-        // Set the permissions for en_passant
-        if((curr_piece == WP || curr_piece == BP) && abs(m.init_pos.first-m.final_pos.first) == 2) {
-            is_en_passant_allowed = true;
-            en_passant_square = {m.final_pos.first, m.final_pos.second};
-        }
-
-        // Set the permissions
-        if(curr_piece == WK) {
-            whiteKcastle = false;
-            whiteQcastle = false;
-        }
-        if(curr_piece == BK) {
-            blackKcastle = false;
-            blackQcastle = false;
-        }
-        if(curr_piece == WR) {
-            if(m.init_pos.second == 7) {
-                whiteKcastle = false;
-            } else if(m.init_pos.second == 0) {
-                whiteQcastle = false;
+    // Set up the position from a FEN string. The move counters at the end may be left out.
+    // Returns false if the string does not describe a position the move generator can take:
+    // eight ranks of eight files, one king a side, no pawn on the first or last rank and
+    // the side which has just moved not left in check.
+    bool set_fen(const std::string &fen) {
+        std::istringstream fields(fen);
+        std::string placement, side, rights, en_passant;
+        int halfmoves = 0;
+        fields >> placement >> side >> rights >> en_passant >> halfmoves;
+
+        clear();
+        const std::string piece_letters = "PNBRQKpnbrqk";
+        int row = 0;
+        int col = 0;
+        for(char c: placement) {
+            if(c == '/') {
+                if(col != 8 || row == 7) {
+                    return false;
+                }
+                row++;
+                col = 0;
+            } else if(c >= '1' && c <= '8') {
+                col += c - '0';
+                if(col > 8) {
+                    return false;
+                }
+            } else {
+                size_t index = piece_letters.find(c);
+                if(index == std::string::npos || col > 7) {
+                    return false;
+                }
+                int piece = WP + int(index);
+                int kind = piece_kind(piece);
+                if((kind == piece_kind(WK) && king_square[get_piece_side(piece)] != INVALID)
+                   || (kind == piece_kind(WP) && (row == 0 || row == 7))) {
+                    return false;
+                }
+                put_piece(square_index(row, col), piece);
+                col++;
             }
         }
-        if(curr_piece == BR) {
-            if(m.init_pos.second == 7) {
-                blackKcastle = false;
-            } else if(m.init_pos.second == 0) {
-                blackQcastle = false;
+        if(row != 7 || col != 8 || king_square[WHITE] == INVALID || king_square[BLACK] == INVALID
+           || (side != "w" && side != "b")) {
+            return false;
+        }
+        side_to_play = (side == "w" ? WHITE : BLACK);
+        if(is_square_attacked(king_square[opposite_side()], side_to_play)) {
+            return false;
+        }
+
+        // Only keep the rights whose king and rook are still on their squares
+        castling = 0;
+        if(rights.empty() || rights.find_first_not_of(rights == "-" ? "-" : "KQkq") != std::string::npos) {
+            return false;
+        }
+        for(char c: rights) {
+            if(c == 'K') castling |= WHITE_K_CASTLE;
+            if(c == 'Q') castling |= WHITE_Q_CASTLE;
+            if(c == 'k') castling |= BLACK_K_CASTLE;
+            if(c == 'q') castling |= BLACK_Q_CASTLE;
+        }
+        if(piece_on(square_index(7, 4)) != WK) castling &= ~(WHITE_K_CASTLE | WHITE_Q_CASTLE);
+        if(piece_on(square_index(7, 7)) != WR) castling &= ~WHITE_K_CASTLE;
+        if(piece_on(square_index(7, 0)) != WR) castling &= ~WHITE_Q_CASTLE;
+        if(piece_on(square_index(0, 4)) != BK) castling &= ~(BLACK_K_CASTLE | BLACK_Q_CASTLE);
+        if(piece_on(square_index(0, 7)) != BR) castling &= ~BLACK_K_CASTLE;
+        if(piece_on(square_index(0, 0)) != BR) castling &= ~BLACK_Q_CASTLE;
+
+        // FEN names the square behind the pawn, on the sixth rank when white is to play and the
+        // third when black is. We keep the pawn itself and, as in make_move, only when one of
+        // our pawns stands beside it.
+        en_passant_square = INVALID;
+        if(en_passant != "-") {
+            char ep_rank = (side_to_play == WHITE ? '6' : '3');
+            if(en_passant.size() != 2 || en_passant[0] < 'a' || en_passant[0] > 'h' || en_passant[1] != ep_rank) {
+                return false;
+            }
+            int pawn_row = 8 - (en_passant[1] - '0') + (side_to_play == WHITE ? 1 : -1);
+            int pawn_sq = square_index(pawn_row, en_passant[0] - 'a');
+            if(piece_on(pawn_sq) != (side_to_play == WHITE ? BP : WP)) {
+                return false;
+            }
+            bitboard beside = ((SQUARE_BB(pawn_sq) << 1) & ~FILE_A) | ((SQUARE_BB(pawn_sq) >> 1) & ~FILE_H);
+            if(beside & pieces(side_to_play == WHITE ? WP : BP)) {
+                en_passant_square = pawn_sq;
             }
         }
-        
-        // Update the move history for the fifty move rule
-        if(m.captured_piece != BLANK || is_pawn(curr_piece)) {
-            fifty_move_history.push_back(0);
+
+        fifty_move_count = halfmoves;
+        key = compute_key();
+        return true;
+    }
+
+    void init() {
+        clear();
+        for(int i = 0; i < 8; i++) {
+            for(int j = 0; j < 8; j++) {
+                if(init_pos[i][j] != BL) {
+                    put_piece(square_index(i, j), init_pos[i][j]);
+                }
+            }
+        }
+        castling = WHITE_K_CASTLE | WHITE_Q_CASTLE | BLACK_K_CASTLE | BLACK_Q_CASTLE;
+        en_passant_square = INVALID;
+        fifty_move_count = 0;
+        side_to_play = WHITE;
+        key = compute_key();
+    }
+
+    // Play the move, saving what is needed to take it back in undo.
+    // The side to play is only looked at here, the work is done by one copy of
+    // make_move_for per side, with the pieces and squares of that side as constants.
+    void make_move(move m, undo_record &undo) {
+        if(side_to_play == WHITE) {
+            make_move_for<WHITE>(m, undo);
         } else {
-            fifty_move_history.push_back(fifty_move_history[fifty_move_history.size()-1] + 1);
+            make_move_for<BLACK>(m, undo);
         }
-        
-        if(m.castle_code != NO_CASTLE) {
-            switch(m.castle_code) {
-                case WHITE_QUEEN_SIDE_CASTLE:
-                    board[7][2] = WK;
-                    board[7][3] = WR;
-                    board[7][0] = BL;
-                    board[7][4] = BL;
-                    whiteQcastle = false;
-                    break;
-                case WHITE_KING_SIDE_CASTLE:
-                    board[7][6] = WK;
-                    board[7][5] = WR;
-                    board[7][4] = BL;
-                    board[7][7] = BL;
-                    whiteKcastle = false;
-                    break;
-                case BLACK_QUEEN_SIDE_CASTLE:
-                    board[0][2] = BK;
-                    board[0][3] = BR;
-                    board[0][0] = BL;
-                    board[0][4] = BL;
-                    blackQcastle = false;
-                    break;
-                case BLACK_KING_SIDE_CASTLE:
-                    board[0][6] = BK;
-                    board[0][5] = BR;
-                    board[0][4] = BL;
-                    board[0][7] = BL;
-                    blackKcastle = false;
-                    break;
+    }
+
+    template<int us>
+    void make_move_for(move m, undo_record &undo) {
+        constexpr int them = (us == WHITE ? BLACK : WHITE);
+        constexpr int pawn = (us == WHITE ? WP : BP);
+        constexpr int rook = (us == WHITE ? WR : BR);
+        constexpr int back_row = (us == WHITE ? 7 : 0);
+        int from = m.from();
+        int to = m.to();
+        int curr_piece = piece_on(from);
+
+        // Save the current key, castling permissions, en_passant square and fifty move count
+        undo.key = key;
+        undo.castling = castling;
+        undo.en_passant_square = en_passant_square;
+        undo.fifty_move_count = fifty_move_count;
+        undo.captured_piece = BL;
+
+        // Remove the captured piece, en passant captures the pawn beside ours
+        if(m.flag() == EN_PASSANT) {
+            undo.captured_piece = (them == WHITE ? WP : BP);
+            remove_piece(en_passant_square, undo.captured_piece);
+            key ^= zobrist_pieces[undo.captured_piece][en_passant_square];
+        } else if(m.is_capture()) {
+            undo.captured_piece = piece_on(to);
+            remove_piece(to, undo.captured_piece);
+            key ^= zobrist_pieces[undo.captured_piece][to];
+        }
+
+        // Update the move count for the fifty move rule
+        if(undo.captured_piece != BL || curr_piece == pawn) {
+            fifty_move_count = 0;
+        } else {
+            fifty_move_count++;
+        }
+
+        // Set the castling permissions
+        key ^= zobrist_castling[castling];
+        update_castle_permissions(from);
+        update_castle_permissions(to);
+        key ^= zobrist_castling[castling];
+
+        int new_piece = m.is_promotion() ? m.promoted_piece(us) : curr_piece;
+        remove_piece(from, curr_piece);
+        put_piece(to, new_piece);
+        key ^= zobrist_pieces[curr_piece][from] ^ zobrist_pieces[new_piece][to];
+
+        // The king has moved two squares, now bring the rook to the other side of it
+        if(m.flag() == KING_CASTLE) {
+            remove_piece(square_index(back_row, 7), rook);
+            put_piece(square_index(back_row, 5), rook);
+            key ^= zobrist_pieces[rook][square_index(back_row, 7)] ^ zobrist_pieces[rook][square_index(back_row, 5)];
+        } else if(m.flag() == QUEEN_CASTLE) {
+            remove_piece(square_index(back_row, 0), rook);
+            put_piece(square_index(back_row, 3), rook);
+            key ^= zobrist_pieces[rook][square_index(back_row, 0)] ^ zobrist_pieces[rook][square_index(back_row, 3)];
+        }
+
+        // En passant is only possible right after a pawn has moved two squares ahead, and
+        // only remembered if an enemy pawn stands beside it, so that the key does not
+        // depend on a capture which cannot happen
+        if(en_passant_square != INVALID) {
+            key ^= zobrist_en_passant[en_passant_square % 8];
+        }
+        en_passant_square = INVALID;
+        if(m.flag() == DOUBLE_PAWN_PUSH) {
+            bitboard beside = ((SQUARE_BB(to) << 1) & ~FILE_A) | ((SQUARE_BB(to) >> 1) & ~FILE_H);
+            if(beside & pieces(them == WHITE ? WP : BP)) {
+                en_passant_square = to;
+                key ^= zobrist_en_passant[to % 8];
             }
-            side_to_play = (side_to_play == WHITE ? BLACK : WHITE);
-            return;
         }
-        board[m.final_pos.first][m.final_pos.second] = board[m.init_pos.first][m.init_pos.second];
-        board[m.init_pos.first][m.init_pos.second] = BLANK;
-        if(m.do_enpassant) {
-            board[en_passant_square.first][en_passant_square.second] = BL;
+
+        key ^= zobrist_side;
+        side_to_play = them;
+    }
+
+    void undo_move(move m, const undo_record &undo) {
+        if(side_to_play == WHITE) {
+            undo_move_for<BLACK>(m, undo);
+        } else {
+            undo_move_for<WHITE>(m, undo);
+        }
+    }
+
+    // Take back a move played by us
+    template<int us>
+    void undo_move_for(move m, const undo_record &undo) {
+        constexpr int rook = (us == WHITE ? WR : BR);
+        constexpr int back_row = (us == WHITE ? 7 : 0);
+        int from = m.from();
+        int to = m.to();
+
+        // Restore the key, castle permissions, en_passant square and fifty move count
+        key = undo.key;
+        castling = undo.castling;
+        en_passant_square = undo.en_passant_square;
+        fifty_move_count = undo.fifty_move_count;
+
+        side_to_play = us;
+
+        int curr_piece = piece_on(to);
+        remove_piece(to, curr_piece);
+        if(m.is_promotion()) {
+            curr_piece = (us == WHITE ? WP : BP);
+        }
+        put_piece(from, curr_piece);
+
+        if(m.flag() == KING_CASTLE) {
+            remove_piece(square_index(back_row, 5), rook);
+            put_piece(square_index(back_row, 7), rook);
+        } else if(m.flag() == QUEEN_CASTLE) {
+            remove_piece(square_index(back_row, 3), rook);
+            put_piece(square_index(back_row, 0), rook);
         }
-        if(m.promoted_piece != BL) {
-            board[m.final_pos.first][m.final_pos.second] = m.promoted_piece;
+
+        if(m.flag() == EN_PASSANT) {
+            put_piece(en_passant_square, undo.captured_piece);
+        } else if(undo.captured_piece != BL) {
+            put_piece(to, undo.captured_piece);
         }
-        side_to_play = (side_to_play == WHITE ? BLACK : WHITE);
     }
 
-    void undo_move(move m) {
-        // Unconditionally restore the castle permissions
-        whiteQcastle = prevWhiteQcastle;
-        whiteKcastle = prevWhiteKcastle;
-        blackQcastle = prevBlackQcastle;
-        blackKcastle = prevBlackKcastle;
-        
-        // Restore the en_passant permissions and square
-        en_passant_square = prev_en_passant_square;
-        is_en_passant_allowed = prev_is_en_passant_allowed;
-        
-        // Deal with the 50 moves rule history
-        fifty_move_history.pop_back();
+    bool is_square_attacked(int sq, int side) const {
+        return side == WHITE ? is_square_attacked_by<WHITE>(sq) : is_square_attacked_by<BLACK>(sq);
+    }
+
+    template<int side>
+    bool is_square_attacked_by(int sq) const {
+        // Look from the square outwards with the attack set of each piece type:
+        // if it reaches an attacker of that type, the attacker reaches the square
+        bitboard queens = pieces(side == WHITE ? WQ : BQ);
+
+        // Check the diagonals for queen/bishop attacks
+        if(bishop_attacks(sq, occupancy[BLANK]) & (pieces(side == WHITE ? WB : BB) | queens)) {
+            return true;
+        }
+
+        // Check the ranks and files for rook/queen attacks
+        if(rook_attacks(sq, occupancy[BLANK]) & (pieces(side == WHITE ? WR : BR) | queens)) {
+            return true;
+        }
+
+        // Check if the square is attacked by a knight
+        if(knight_attacks[sq] & pieces(side == WHITE ? WN : BN)) {
+            return true;
+        }
+
+        // Let's check for pawn attacks, a pawn of the other side standing on the
+        // square would attack exactly the squares from which our pawns attack it
+        if(pawn_attacks[side == WHITE ? BLACK : WHITE][sq] & pieces(side == WHITE ? WP : BP)) {
+            return true;
+        }
+
+        // Finally we check for king attacks
+        if(king_attacks[sq] & pieces(side == WHITE ? WK : BK)) {
+            return true;
+        }
         
-        if(m.castle_code != NO_CASTLE) {
-            switch(m.castle_code) {
-                case WHITE_QUEEN_SIDE_CASTLE:
-                    board[7][2] = BL;
-                    board[7][3] = BL;
-                    board[7][0] = WR;
-                    board[7][4] = WK;
-                    break;
-                case WHITE_KING_SIDE_CASTLE:
-                    board[7][6] = BL;
-                    board[7][5] = BL;
-                    board[7][4] = WK;
-                    board[7][7] = WR;
-                    break;
-                case BLACK_QUEEN_SIDE_CASTLE:
-                    board[0][2] = BL;
-                    board[0][3] = BL;
-                    board[0][0] = BR;
-                    board[0][4] = BK;
-                    break;
-                case BLACK_KING_SIDE_CASTLE:
-                    board[0][6] = BL;
-                    board[0][5] = BL;
-                    board[0][4] = BK;
-                    board[0][7] = BR;
-                    break;
-            }
-            side_to_play = (side_to_play == WHITE ? BLACK : WHITE);
-            return;
+        // If the square is not attacked, return false
+        return false;
+    }
+    
+    // Every square attacked by side, with the given occupancy for the sliders.
+    // All the pawns are shifted at once, the other pieces are looked up one by one.
+    template<int side>
+    bitboard attacks_by(bitboard occupied) const {
+        bitboard pawns = pieces(side == WHITE ? WP : BP);
+        bitboard attacks;
+        if(side == WHITE) {
+            attacks = ((pawns >> 9) & ~FILE_H) | ((pawns >> 7) & ~FILE_A);
+        } else {
+            attacks = ((pawns << 7) & ~FILE_H) | ((pawns << 9) & ~FILE_A);
         }
 
-        board[m.init_pos.first][m.init_pos.second] = board[m.final_pos.first][m.final_pos.second];
-        board[m.final_pos.first][m.final_pos.second] = m.captured_piece;
-        if(m.do_enpassant) {
-            board[m.final_pos.first][m.final_pos.second] = BL;
-            board[prev_en_passant_square.first][prev_en_passant_square.second] = m.captured_piece;
+        bitboard knights = pieces(side == WHITE ? WN : BN);
+        while(knights) {
+            attacks |= knight_attacks[pop_lsb(knights)];
+        }
+        bitboard queens = pieces(side == WHITE ? WQ : BQ);
+        bitboard diagonal = pieces(side == WHITE ? WB : BB) | queens;
+        while(diagonal) {
+            attacks |= bishop_attacks(pop_lsb(diagonal), occupied);
         }
-        if(m.promoted_piece != BL) {
-            board[m.init_pos.first][m.init_pos.second] = side_to_play == WHITE ? BP : WP;
+        bitboard straight = pieces(side == WHITE ? WR : BR) | queens;
+        while(straight) {
+            attacks |= rook_attacks(pop_lsb(straight), occupied);
         }
-        side_to_play = (side_to_play == WHITE ? BLACK : WHITE);
+        return attacks | king_attacks[king_square[side]];
     }
 
-    bool is_square_attacked(std::pair<int, int> square, int side) {
-        // Check if the square is attacked by any slider pieces
+    bitboard attacked_squares(int side) const {
+        return side == WHITE ? attacks_by<WHITE>(occupancy[BLANK]) : attacks_by<BLACK>(occupancy[BLANK]);
+    }
 
-        int i = square.first;
-        int j = square.second;
-        int var_i, var_j, piece;
+    // All pieces of both sides which attack sq, with the given occupancy for the sliders
+    bitboard attackers_to(int sq, bitboard occupied) const {
+        return (pawn_attacks[BLACK][sq] & pieces(WP))
+             | (pawn_attacks[WHITE][sq] & pieces(BP))
+             | (knight_attacks[sq] & kinds[piece_kind(WN)])
+             | (king_attacks[sq] & kinds[piece_kind(WK)])
+             | (bishop_attacks(sq, occupied) & (kinds[piece_kind(WB)] | kinds[piece_kind(WQ)]))
+             | (rook_attacks(sq, occupied) & (kinds[piece_kind(WR)] | kinds[piece_kind(WQ)]));
+    }
 
-        // Check the diagonals for queen/bishop attacks
-        var_i = i + 1;
-        var_j = j + 1;
-        while(is_square_in_range(var_i, var_j)) {
-            piece = board[var_i][var_j];
-            if(get_piece_side(piece) == side && is_diagonal_attacker(piece)) {
-                return true;
-            } else if(get_piece_side(piece) == BLANK) {
-                var_i++;
-                var_j++;
-            } else {
-                break;
+    // Pieces of either side which are the only piece between the king of side and an enemy slider
+    template<int side>
+    bitboard king_blockers() const {
+        constexpr int them = (side == WHITE ? BLACK : WHITE);
+        int king_sq = king_square[side];
+        bitboard queens = pieces(them == WHITE ? WQ : BQ);
+        bitboard snipers = (rook_attacks(king_sq, 0) & (pieces(them == WHITE ? WR : BR) | queens))
+                         | (bishop_attacks(king_sq, 0) & (pieces(them == WHITE ? WB : BB) | queens));
+
+        bitboard blockers = 0;
+        while(snipers) {
+            bitboard in_between = between_bb[king_sq][pop_lsb(snipers)] & occupancy[BLANK];
+            if(popcount(in_between) == 1) {
+                blockers |= in_between;
             }
         }
+        return blockers;
+    }
+
+    // Our pieces which are the only piece between our king and an enemy slider
+    template<int us>
+    bitboard pinned_pieces() const {
+        return king_blockers<us>() & occupancy[us];
+    }
+
+    check_info get_check_info() const {
+        return side_to_play == WHITE ? check_info_for<WHITE>() : check_info_for<BLACK>();
+    }
 
-        var_i = i + 1;
-        var_j = j - 1;
-        while(is_square_in_range(var_i, var_j)) {
-            piece = board[var_i][var_j];
-            if(get_piece_side(piece) == side && is_diagonal_attacker(piece)) {
+    template<int us>
+    check_info check_info_for() const {
+        constexpr int them = (us == WHITE ? BLACK : WHITE);
+        check_info info;
+        info.enemy_king = king_square[them];
+        int king_sq = info.enemy_king;
+
+        // A piece of ours checks from the squares it would attack if it stood on the king's square
+        info.check_squares[piece_kind(WP)] = pawn_attacks[them][king_sq];
+        info.check_squares[piece_kind(WN)] = knight_attacks[king_sq];
+        info.check_squares[piece_kind(WB)] = bishop_attacks(king_sq, occupancy[BLANK]);
+        info.check_squares[piece_kind(WR)] = rook_attacks(king_sq, occupancy[BLANK]);
+        info.check_squares[piece_kind(WQ)] = info.check_squares[piece_kind(WB)] | info.check_squares[piece_kind(WR)];
+        info.check_squares[piece_kind(WK)] = 0;
+        info.discovery_candidates = king_blockers<them>() & occupancy[us];
+        return info;
+    }
+
+    // Whether the move checks the enemy king, found without playing it
+    bool gives_check(move m, const check_info &info) const {
+        int us = side_to_play;
+        int from = m.from();
+        int to = m.to();
+        int king_sq = info.enemy_king;
+        bitboard king = SQUARE_BB(king_sq);
+        bitboard occupied = occupancy[BLANK] ^ SQUARE_BB(from);
+
+        // Direct check, a promoted pawn checks with the piece it becomes
+        if(m.is_promotion()) {
+            if(piece_attacks(m.promoted_piece(us), to, occupied) & king) {
                 return true;
-            } else if(get_piece_side(piece) == BLANK) {
-                var_i++;
-                var_j--;
-            } else {
-                break;
             }
+        } else if(info.check_squares[piece_kind(piece_on(from))] & SQUARE_BB(to)) {
+            return true;
         }
 
-        var_i = i - 1;
-        var_j = j - 1;
-        while(is_square_in_range(var_i, var_j)) {
-            piece = board[var_i][var_j];
-            if(get_piece_side(piece) == side && is_diagonal_attacker(piece)) {
-                return true;
-            } else if(get_piece_side(piece) == BLANK) {
-                var_i--;
-                var_j--;
-            } else {
-                break;
-            }
+        // Discovered check, unless the piece moves along the line to the king
+        if((info.discovery_candidates & SQUARE_BB(from)) && !(line_bb[from][king_sq] & SQUARE_BB(to))) {
+            return true;
         }
 
-        var_i = i - 1;
-        var_j = j + 1;
-        while(is_square_in_range(var_i, var_j)) {
-            piece = board[var_i][var_j];
-            if(get_piece_side(piece) == side && is_diagonal_attacker(piece)) {
-                return true;
-            } else if(get_piece_side(piece) == BLANK) {
-                var_i--;
-                var_j++;
-            } else {
-                break;
-            }
+        if(m.flag() == EN_PASSANT) {
+            // The captured pawn may have been the only piece between one of our sliders and the king
+            occupied = (occupied ^ SQUARE_BB(en_passant_square)) | SQUARE_BB(to);
+            bitboard queens = pieces(us == WHITE ? WQ : BQ);
+            return (bishop_attacks(king_sq, occupied) & (pieces(us == WHITE ? WB : BB) | queens))
+                || (rook_attacks(king_sq, occupied) & (pieces(us == WHITE ? WR : BR) | queens));
         }
+        if(m.is_castle()) {
+            // The rook lands next to the king, on the side it came from
+            int rook_from = square_index(from / 8, m.flag() == KING_CASTLE ? 7 : 0);
+            int rook_to = square_index(from / 8, m.flag() == KING_CASTLE ? 5 : 3);
+            occupied = (occupied ^ SQUARE_BB(rook_from)) | SQUARE_BB(to) | SQUARE_BB(rook_to);
+            return rook_attacks(rook_to, occupied) & king;
+        }
+        return false;
+    }
+    
+    // Add a pawn move, or all four promotions when it reaches the last rank
+    template<typename list_type>
+    void add_pawn_move(list_type &movelist, int from, int to, int capture_flag) const {
+        if(to / 8 != 7 && to / 8 != 0) {
+            movelist.push_back(move(from, to, capture_flag));
+        } else {
+            movelist.push_back(move(from, to, QUEEN_PROMOTION | capture_flag));
+            movelist.push_back(move(from, to, ROOK_PROMOTION | capture_flag));
+            movelist.push_back(move(from, to, BISHOP_PROMOTION | capture_flag));
+            movelist.push_back(move(from, to, KNIGHT_PROMOTION | capture_flag));
+        }
+    }
 
-        // Check the diagonals for rook/queen attacks
-        var_i = i + 1;
-        var_j = j;
-        while(is_square_in_range(var_i, var_j)) {
-            piece = board[var_i][var_j];
-            if(get_piece_side(piece) == side && is_straight_attacker(piece)) {
-                return true;
-            } else if(get_piece_side(piece) == BLANK) {
-                var_i++;
-            } else {
-                break;
-            }
+    // The squares a non-pawn piece may move to for the kind of moves asked for
+    template<int us>
+    bitboard target_squares(int gen_type) const {
+        constexpr int them = (us == WHITE ? BLACK : WHITE);
+        if(gen_type == CAPTURE_MOVES) {
+            return occupancy[them];
+        }
+        if(gen_type == QUIET_MOVES) {
+            return ~occupancy[BLANK];
         }
+        return ~occupancy[us];
+    }
 
-        var_i = i;
-        var_j = j + 1;
-        while(is_square_in_range(var_i, var_j)) {
-            piece = board[var_i][var_j];
-            if(get_piece_side(piece) == side && is_straight_attacker(piece)) {
-                return true;
-            } else if(get_piece_side(piece) == BLANK) {
-                var_j++;
-            } else {
-                break;
-            }
+    // A pawn push belongs with the captures if it promotes, and with the quiet moves otherwise
+    bool wants_push(int gen_type, int to) const {
+        bool promotion = (to / 8 == 7 || to / 8 == 0);
+        return gen_type == ALL_MOVES || (gen_type == CAPTURE_MOVES) == promotion;
+    }
+
+    // The king may not step onto a square in danger, one attacked by the enemy
+    // with our king taken off the board, so that a slider checking it along a line
+    // also covers the square behind it
+    template<int us, typename list_type>
+    void generate_king_moves(list_type &movelist, int gen_type, bitboard danger) const {
+        constexpr int them = (us == WHITE ? BLACK : WHITE);
+        int king_sq = king_square[us];
+        bitboard targets = king_attacks[king_sq] & target_squares<us>(gen_type) & ~danger;
+        movelist.add_moves(king_sq, targets, occupancy[them]);
+    }
+
+    // Enpassant captures by the pawns next to the pawn which has just moved two squares ahead.
+    // Two pawns leave the line at once here, so instead of the pin mask look directly
+    // whether an enemy slider sees our king once the capture is made.
+    template<int us, typename list_type>
+    void generate_en_passant(list_type &movelist, bitboard check_mask, bitboard checkers) const {
+        constexpr int them = (us == WHITE ? BLACK : WHITE);
+        if(en_passant_square == INVALID) {
+            return;
+        }
+        int king_sq = king_square[us];
+        int to = en_passant_square + (us == WHITE ? -8 : 8);
+        bool resolves_check = (check_mask & SQUARE_BB(to)) || (checkers & SQUARE_BB(en_passant_square));
+        if(!resolves_check) {
+            return;
         }
 
-        var_i = i - 1;
-        var_j = j;
-        while(is_square_in_range(var_i, var_j)) {
-            piece = board[var_i][var_j];
-            if(get_piece_side(piece) == side && is_straight_attacker(piece)) {
-                return true;
-            } else if(get_piece_side(piece) == BLANK) {
-                var_i--;
-            } else {
-                break;
+        // Our pawns which would attack the square behind the pawn are the ones standing beside it
+        bitboard capturers = pawn_attacks[them][to] & pieces(us == WHITE ? WP : BP);
+        bitboard queens = pieces(them == WHITE ? WQ : BQ);
+        while(capturers) {
+            int from = pop_lsb(capturers);
+            bitboard after = (occupancy[BLANK] ^ SQUARE_BB(from) ^ SQUARE_BB(en_passant_square)) | SQUARE_BB(to);
+            bool exposes_king = (bishop_attacks(king_sq, after) & (pieces(them == WHITE ? WB : BB) | queens))
+                             || (rook_attacks(king_sq, after) & (pieces(them == WHITE ? WR : BR) | queens));
+            if(!exposes_king) {
+                movelist.push_back(move(from, to, EN_PASSANT));
             }
         }
+    }
 
-        var_i = i;
-        var_j = j - 1;
-        while(is_square_in_range(var_i, var_j)) {
-            piece = board[var_i][var_j];
-            if(get_piece_side(piece) == side && is_straight_attacker(piece)) {
-                return true;
-            } else if(get_piece_side(piece) == BLANK) {
-                var_j--;
-            } else {
-                break;
+    // The replies to a check: king moves, and with a single checker the captures of it and the
+    // interpositions on its ray. Instead of trying all of our pieces against those few squares,
+    // look from each square for the pieces which can reach it.
+    // Pinned pieces never help here, capturing or blocking would take them off their pin line.
+    template<int us, typename list_type>
+    void generate_evasions(list_type &movelist, bitboard checkers, bitboard danger, int gen_type) const {
+        constexpr int increment = (us == WHITE ? -8 : 8);
+        constexpr int double_push_row = (us == WHITE ? 4 : 3);
+        int king_sq = king_square[us];
+        bitboard all_pieces = occupancy[BLANK];
+
+        generate_king_moves<us>(movelist, gen_type, danger);
+
+        // In double check only the king can move
+        if(popcount(checkers) > 1) {
+            return;
+        }
+
+        int checker_sq = lsb(checkers);
+        bitboard pawns = pieces(us == WHITE ? WP : BP);
+        bitboard free_pieces = occupancy[us] & ~pinned_pieces<us>() & ~SQUARE_BB(king_sq);
+
+        // Capture the checker
+        if(gen_type != QUIET_MOVES) {
+            bitboard capturers = attackers_to(checker_sq, all_pieces) & free_pieces;
+            while(capturers) {
+                int from = pop_lsb(capturers);
+                if(pawns & SQUARE_BB(from)) {
+                    add_pawn_move(movelist, from, checker_sq, CAPTURE);
+                } else {
+                    movelist.push_back(move(from, checker_sq, CAPTURE));
+                }
             }
+            generate_en_passant<us>(movelist, checkers, checkers);
         }
 
-        // Check if the square is attacked by a night
-        // The directions in which the knights can move
-        std::pair<int, int> knight_moves[] = {{1, 2}, {1, -2}, {-1, 2}, {-1, -2},
-                                              {2, 1}, {2, -1}, {-2, 1}, {-2, -1}};
+        // Block the ray of a checking slider, pawns can only block with a push
+        bitboard blocks = between_bb[king_sq][checker_sq];
+        while(blocks) {
+            int to = pop_lsb(blocks);
+            if(gen_type != CAPTURE_MOVES) {
+                bitboard blockers = attackers_to(to, all_pieces) & free_pieces & ~pawns;
+                while(blockers) {
+                    movelist.push_back(move(pop_lsb(blockers), to, QUIET));
+                }
+            }
 
-        for(auto next : knight_moves) {
-            var_i = i + next.first;
-            var_j = j + next.second;
-            if(is_square_in_range(var_i, var_j)) {
-                piece = board[var_i][var_j];
-                if(get_piece_side(piece) == side && is_knight(piece)) {
-                    return true;
+            // The square behind as a shifted set, to - increment is off the board on the last rank
+            bitboard behind = (us == WHITE ? SQUARE_BB(to) << 8 : SQUARE_BB(to) >> 8);
+            if(pawns & free_pieces & behind) {
+                if(wants_push(gen_type, to)) {
+                    add_pawn_move(movelist, to - increment, to, QUIET);
                 }
+            } else if(gen_type != CAPTURE_MOVES && to / 8 == double_push_row && !(all_pieces & behind)
+                      && (pawns & free_pieces & SQUARE_BB(to - 2 * increment))) {
+                movelist.push_back(move(to - 2 * increment, to, DOUBLE_PAWN_PUSH));
             }
         }
-        
-        // Let's check for pawn attacks
-        int increment_sign = (side == WHITE ? 1 : -1);
-        
-        var_i = i + increment_sign;
-        var_j = j + 1;
-        if(is_square_in_range(var_i, var_j)) {
-            piece = board[var_i][var_j];
-            if(get_piece_side(piece) == side && is_pawn(piece)) {
-                return true;
-            }
+    }
+
+    // Fill the caller's list with the legal moves of the kind asked for: the captures, which
+    // include en passant and all promotions, the quiet moves, or both.
+    void generate_moves(move_list &movelist, int gen_type) const {
+        if(side_to_play == WHITE) {
+            generate_moves_for<WHITE>(movelist, gen_type);
+        } else {
+            generate_moves_for<BLACK>(movelist, gen_type);
         }
+    }
 
-        var_i = i + increment_sign;
-        var_j = j - 1;
-        if(is_square_in_range(var_i, var_j)) {
-            piece = board[var_i][var_j];
-            if(get_piece_side(piece) == side && is_pawn(piece)) {
-                return true;
+    // The pinned pieces are worked out once, and then every piece is only given targets
+    // on the line of its pin, so no move has to be played to find out whether it is legal.
+    // Positions in check go to the evasion generator instead.
+    template<int us, typename list_type>
+    void generate_moves_for(list_type &movelist, int gen_type) const {
+        constexpr int them = (us == WHITE ? BLACK : WHITE);
+        constexpr int increment = (us == WHITE ? -8 : 8);
+        constexpr int back_row = (us == WHITE ? 7 : 0);
+        constexpr int double_push_row = (us == WHITE ? 6 : 1);
+        constexpr int king_side = (us == WHITE ? WHITE_K_CASTLE : BLACK_K_CASTLE);
+        constexpr int queen_side = (us == WHITE ? WHITE_Q_CASTLE : BLACK_Q_CASTLE);
+        movelist.count = 0;
+        int king_sq = king_square[us];
+        bitboard all_pieces = occupancy[BLANK];
+
+        if(king_sq == INVALID) {
+            std::cout << "INVALID chess position, king not found on board\n\n";
+            assert(false);
+        }
+
+        bitboard checkers = attackers_to(king_sq, all_pieces) & occupancy[them];
+        bitboard danger = attacks_by<them>(all_pieces ^ SQUARE_BB(king_sq));
+        if(checkers) {
+            generate_evasions<us>(movelist, checkers, danger, gen_type);
+            return;
+        }
+
+        bitboard pinned = pinned_pieces<us>();
+        bitboard targets = target_squares<us>(gen_type);
+
+        // A pinned piece may only move along the line of its pin
+        auto pin_mask = [&](int sq) {
+            return (pinned & SQUARE_BB(sq)) ? line_bb[king_sq][sq] : ~0ULL;
+        };
+
+        generate_king_moves<us>(movelist, gen_type, danger);
+
+        // Castles
+        // The king may not castle through or into check, and we know it is not in check now.
+        // Taking the king off the board changes nothing here, a slider seeing through it would give check.
+        bitboard queen_side_path = SQUARE_BB(square_index(back_row, 1)) | SQUARE_BB(square_index(back_row, 2)) | SQUARE_BB(square_index(back_row, 3));
+        bitboard king_side_path = SQUARE_BB(square_index(back_row, 5)) | SQUARE_BB(square_index(back_row, 6));
+
+        if(gen_type != CAPTURE_MOVES) {
+            bitboard queen_side_king_path = SQUARE_BB(square_index(back_row, 2)) | SQUARE_BB(square_index(back_row, 3));
+            if((castling & queen_side) && !(all_pieces & queen_side_path) && !(danger & queen_side_king_path)) {
+                movelist.push_back(move(square_index(back_row, 4), square_index(back_row, 2), QUEEN_CASTLE));
+            }
+            if((castling & king_side) && !(all_pieces & king_side_path) && !(danger & king_side_path)) {
+                movelist.push_back(move(square_index(back_row, 4), square_index(back_row, 6), KING_CASTLE));
             }
         }
-        
-        // Finally we check for king attacks
-        // The directions in which a king can move
-        std::pair<int, int> king_moves[] = {{0, 1}, {0, -1}, {1, 0}, {-1, 0},
-                                        {1, 1}, {1, -1}, {-1, 1}, {-1, -1}};
-
-        for(auto next : king_moves) {
-            var_i = i + next.first;
-            var_j = j + next.second;
-            if(is_square_in_range(var_i, var_j)) {
-                piece = board[var_i][var_j];
-                if(get_piece_side(piece) == side && is_king(piece)) {
-                    return true;
+
+        // Pawns, the only pieces whose moves are not their attacks
+        bitboard pawns = pieces(us == WHITE ? WP : BP);
+        while(pawns) {
+            int sq = pop_lsb(pawns);
+            bitboard legal_mask = pin_mask(sq);
+
+            // Move the pawns 1 square ahead, and then 2 squares ahead if the conditions are satisfied
+            int next_sq = sq + increment;
+            if(!(all_pieces & SQUARE_BB(next_sq)) && (legal_mask & SQUARE_BB(next_sq))) {
+                if(wants_push(gen_type, next_sq)) {
+                    add_pawn_move(movelist, sq, next_sq, QUIET);
+                }
+
+                int double_sq = next_sq + increment;
+                if(gen_type != CAPTURE_MOVES && sq / 8 == double_push_row && !(all_pieces & SQUARE_BB(double_sq))) {
+                    movelist.push_back(move(sq, double_sq, DOUBLE_PAWN_PUSH));
                 }
             }
-        }
-        
-        // If the square is not attacked, return false
-        return false;
-    }
-    
-    auto get_filtered_moves(auto movelist) {
-        std::pair<int, int> king_sq = {INVALID, INVALID};
-        int king = INVALID;
-        
-        for(int i = 0; i < 8; i++) {
-            for(int j = 0; j < 8; j++) {
-                if(is_king(board[i][j]) && get_piece_side(board[i][j]) == side_to_play) {
-                    king_sq = {i, j};
-                    king = board[i][j];
+
+            // Diagonal captures
+            if(gen_type != QUIET_MOVES) {
+                bitboard captures = pawn_attacks[us][sq] & occupancy[them] & legal_mask;
+                while(captures) {
+                    add_pawn_move(movelist, sq, pop_lsb(captures), CAPTURE);
                 }
             }
         }
-        
-        if(king == INVALID) {
-            std::cout << "INVALID chess position, king not found on board\n\n";
-            assert(false);
+        if(gen_type != QUIET_MOVES) {
+            generate_en_passant<us>(movelist, ~0ULL, 0);
         }
-        
-        int attacking_side = opposite_side();
-        
-        std::vector<move> filtered_moves;
-        for(move m: movelist) {
-            make_move(m);
-            if(board[m.final_pos.first][m.final_pos.second] == king) {
-                king_sq = m.final_pos;
-            }
-            if(!is_square_attacked(king_sq, attacking_side)) {
-                filtered_moves.push_back(m);
+
+        // Knights and sliders: capture an opponent piece or just move somewhere
+        constexpr int first_piece = (us == WHITE ? WN : BN);
+        constexpr int last_piece = (us == WHITE ? WQ : BQ);
+        for(int curr_piece = first_piece; curr_piece <= last_piece; curr_piece++) {
+            bitboard piece_set = pieces(curr_piece);
+            while(piece_set) {
+                int sq = pop_lsb(piece_set);
+                movelist.add_moves(sq, piece_attacks(curr_piece, sq, all_pieces) & targets & pin_mask(sq), occupancy[them]);
             }
-            undo_move(m);
         }
-        
-        return filtered_moves;
-        
     }
-    
-    auto generate_all_moves() {
-        std::vector <move> movelist;
 
-        // Castles
-        if(side_to_play == WHITE && whiteQcastle == true
-           && board[7][1] == BL && board[7][2] == BL
-           && board[7][3] == BL && !is_square_attacked({7,2}, BLACK) && !is_square_attacked({7, 3}, BLACK)) {
-            movelist.push_back(move(WHITE_QUEEN_SIDE_CASTLE));
+    void generate_all_moves(move_list &movelist) const {
+        generate_moves(movelist, ALL_MOVES);
+    }
+
+    // Captures, en passant and promotions only, for a quiescence search
+    void generate_captures(move_list &movelist) const {
+        generate_moves(movelist, CAPTURE_MOVES);
+    }
+
+    // Everything generate_captures leaves out, castles included
+    void generate_quiets(move_list &movelist) const {
+        generate_moves(movelist, QUIET_MOVES);
+    }
+
+    // The number of legal moves, found with the generator but without writing out any move
+    int count_legal_moves() const {
+        move_counter counter;
+        if(side_to_play == WHITE) {
+            generate_moves_for<WHITE>(counter, ALL_MOVES);
+        } else {
+            generate_moves_for<BLACK>(counter, ALL_MOVES);
         }
-        if(side_to_play == WHITE && whiteKcastle == true
-           && board[7][5] == BL && board[7][6] == BL && !is_square_attacked({7, 5}, BLACK) && !is_square_attacked({7, 6}, BLACK)) {
-            movelist.push_back(move(WHITE_KING_SIDE_CASTLE));
+        return counter.count;
+    }
+
+    // Whether a move from somewhere else, like the hash table or the killer slots, is one
+    // the generator could produce here, ignoring only whether it leaves our king in check.
+    // Each flag is checked against the piece on the from square, the occupancy and the rights.
+    bool is_pseudo_legal(move m) const {
+        int us = side_to_play;
+        int them = opposite_side();
+        int from = m.from();
+        int to = m.to();
+        int flag = m.flag();
+        bitboard to_bb = SQUARE_BB(to);
+
+        if(m == NULL_MOVE || !(occupancy[us] & SQUARE_BB(from)) || (occupancy[us] & to_bb)) {
+            return false;
         }
-        if(side_to_play == BLACK && blackQcastle == true
-           && board[0][1] == BL && board[0][2] == BL
-           && board[0][3] == BL && !is_square_attacked({0, 2}, WHITE) && !is_square_attacked({0, 3}, WHITE)) {
-            movelist.push_back(move(BLACK_QUEEN_SIDE_CASTLE));
+
+        int piece = piece_on(from);
+        int back_row = (us == WHITE ? 7 : 0);
+
+        // Castles, the rights guarantee that the king and the rook are on their squares
+        if(m.is_castle()) {
+            bool king_side = (flag == KING_CASTLE);
+            int right = us == WHITE ? (king_side ? WHITE_K_CASTLE : WHITE_Q_CASTLE)
+                                    : (king_side ? BLACK_K_CASTLE : BLACK_Q_CASTLE);
+            int rook_sq = square_index(back_row, king_side ? 7 : 0);
+            return (castling & right) && from == square_index(back_row, 4)
+                && to == square_index(back_row, king_side ? 6 : 2)
+                && !(between_bb[from][rook_sq] & occupancy[BLANK]);
         }
-        if(side_to_play == BLACK && blackKcastle == true
-           && board[0][5] == BL && board[0][6] == BL  && !is_square_attacked({0, 5}, WHITE) && !is_square_attacked({0, 6}, WHITE)) {
-            movelist.push_back(move(BLACK_KING_SIDE_CASTLE));
+
+        // The target square must hold an enemy piece exactly when the move says it captures
+        if(flag != EN_PASSANT && bool(m.is_capture()) != bool(occupancy[them] & to_bb)) {
+            return false;
         }
 
-        for(int i = 0; i < 8; i++) {
-            for(int j = 0; j < 8; j++) {
-                int curr_piece = board[i][j];
-
-                // The square where the piece will move
-                int var_i;
-                int var_j;
-                int next_piece;
-
-                if(get_piece_side(curr_piece) == side_to_play) {
-                    // Now slide the piece in all directions
-
-                    // Lots of diagonal moves now!! -> in all 4 directions -> Bishops and Queens
-                    if(is_slider(curr_piece) && curr_piece != WR && curr_piece != BR) {
-                        var_i = i + 1;
-                        var_j = j + 1;
-                        while(is_square_in_range(var_i, var_j)) {
-                            next_piece = board[var_i][var_j];
-                            if(get_piece_side(next_piece) == opposite_side()) {
-                                movelist.push_back(move({i, j}, {var_i, var_j}, next_piece));
-                                break;
-                            } else if(get_piece_side(next_piece) == BLANK) {
-                                movelist.push_back(move({i, j}, {var_i, var_j}));
-                                var_i++;
-                                var_j++;
-                            } else {
-                                break;
-                            }
-                        }
+        if(is_pawn(piece)) {
+            int increment = (us == WHITE ? -8 : 8);
+            bool last_row = (to / 8 == 7 - back_row);
+            if(bool(m.is_promotion()) != last_row) {
+                return false;
+            }
+            if(flag == EN_PASSANT) {
+                return en_passant_square != INVALID && to == en_passant_square + increment
+                    && (pawn_attacks[us][from] & to_bb);
+            }
+            if(m.is_capture()) {
+                return (flag == CAPTURE || m.is_promotion()) && (pawn_attacks[us][from] & to_bb);
+            }
+            if(flag == DOUBLE_PAWN_PUSH) {
+                return from / 8 == back_row - (us == WHITE ? 1 : -1) && to == from + 2 * increment
+                    && !(occupancy[BLANK] & (SQUARE_BB(from + increment) | to_bb));
+            }
+            return to == from + increment && !(occupancy[BLANK] & to_bb);
+        }
+
+        // Every other piece only makes plain moves and captures along its attacks
+        if(flag != QUIET && flag != CAPTURE) {
+            return false;
+        }
+        return piece_attacks(piece, from, occupancy[BLANK]) & to_bb;
+    }
+
+    // Whether a pseudo legal move keeps our king out of check.
+    // Play the move on the occupancy alone and look for enemy attackers of the king, leaving
+    // out the captured piece. That covers pins, checks and the en passant discovery at once.
+    bool is_legal(move m) const {
+        int us = side_to_play;
+        int them = opposite_side();
+        int from = m.from();
+        int to = m.to();
+        int king_sq = king_square[us];
+
+        if(m.is_castle()) {
+            // Not out of, through or into check
+            int step = (to > from ? 1 : -1);
+            bitboard enemy_attacks = attacked_squares(them);
+            return !(enemy_attacks & (SQUARE_BB(from) | SQUARE_BB(from + step) | SQUARE_BB(to)));
+        }
+
+        int captured_sq = (m.flag() == EN_PASSANT ? en_passant_square : to);
+        bitboard occupied = (occupancy[BLANK] ^ SQUARE_BB(from) ^ SQUARE_BB(captured_sq)) | SQUARE_BB(to);
+        if(from == king_sq) {
+            king_sq = to;
+        }
+        return !(attackers_to(king_sq, occupied) & occupancy[them] & ~SQUARE_BB(captured_sq));
+    }
+};
+
+static_assert(std::is_trivially_copyable<position>::value, "a position must be copyable with memcpy");
+#ifndef MAILBOX
+static_assert(sizeof(position) <= 128, "a position must fit in two cache lines");
+#endif
+
+// The stages of the move picker. A stage is only generated once the one before it is used up,
+// so a node which cuts off on the hash move or a capture never generates its quiet moves.
+enum {HASH_MOVE_STAGE, GENERATE_CAPTURES_STAGE, CAPTURES_STAGE, KILLERS_STAGE,
+      GENERATE_QUIETS_STAGE, QUIETS_STAGE, END_STAGE};
+
+// Hands out the legal moves of a position one at a time for a search: the hash move first,
+// then the captures with the most valuable victim and the least valuable attacker first,
+// then the killer moves, and then the remaining quiet moves.
+// The hash and killer moves come from other positions, so each is checked before it is returned.
+class move_picker {
+private:
+    const position &pos;
+    move hash_move;
+    move killers[2];
+    int stage;
+    move_list movelist;
+    int scores[MAX_MOVES];
+    int index;
+
+    // Most valuable victim, least valuable attacker
+    void score_captures() {
+        static const int piece_values[6] = {1, 3, 3, 5, 9, 0};
+        for(int i = 0; i < movelist.size(); i++) {
+            move m = movelist[i];
+            int attacker = pos.piece_kind(pos.piece_on(m.from()));
+            // En passant lands on an empty square, its victim is a pawn
+            int victim = 0;
+            if(m.flag() == EN_PASSANT) {
+                victim = piece_values[0];
+            } else if(m.is_capture()) {
+                victim = piece_values[pos.piece_kind(pos.piece_on(m.to()))];
+            }
+            if(m.is_promotion()) {
+                victim += piece_values[pos.piece_kind(m.promoted_piece(WHITE))];
+            }
+            scores[i] = 16 * victim - attacker;
+        }
+    }
+
+    // Swap the best scored move left in the list to the front of what remains and return it
+    move pick_best() {
+        int best = index;
+        for(int i = index + 1; i < movelist.size(); i++) {
+            if(scores[i] > scores[best]) {
+                best = i;
+            }
+        }
+        std::swap(movelist[best], movelist[index]);
+        std::swap(scores[best], scores[index]);
+        return movelist[index++];
+    }
 
-                        var_i = i - 1;
-                        var_j = j - 1;
-                        while(is_square_in_range(var_i, var_j)) {
-                            next_piece = board[var_i][var_j];
-                            if(get_piece_side(next_piece) == opposite_side()) {
-                                movelist.push_back(move({i, j}, {var_i, var_j}, next_piece));
-                                break;
-                            } else if(get_piece_side(next_piece) == BLANK) {
-                                movelist.push_back(move({i, j}, {var_i, var_j}));
-                                var_i--;
-                                var_j--;
-                            } else {
-                                break;
-                            }
-                        }
-                        var_i = i + 1;
-                        var_j = j - 1;
-                        while(is_square_in_range(var_i, var_j)) {
-                            next_piece = board[var_i][var_j];
-                            if(get_piece_side(next_piece) == opposite_side()) {
-                                movelist.push_back(move({i, j}, {var_i, var_j}, next_piece));
-                                break;
-                            } else if(get_piece_side(next_piece) == BLANK) {
-                                movelist.push_back(move({i, j}, {var_i, var_j}));
-                                var_i++;
-                                var_j--;
-                            } else {
-                                break;
-                            }
-                        }
+public:
+    move_picker(const position &p, move hash, move killer_1, move killer_2) : pos(p) {
+        hash_move = hash;
+        killers[0] = killer_1;
+        killers[1] = killer_2;
+        stage = HASH_MOVE_STAGE;
+        index = 0;
+    }
 
-                        var_i = i - 1;
-                        var_j = j + 1;
-                        while(is_square_in_range(var_i, var_j)) {
-                            next_piece = board[var_i][var_j];
-                            if(get_piece_side(next_piece) == opposite_side()) {
-                                movelist.push_back(move({i, j}, {var_i, var_j}, next_piece));
-                                break;
-                            } else if(get_piece_side(next_piece) == BLANK) {
-                                movelist.push_back(move({i, j}, {var_i, var_j}));
-                                var_i--;
-                                var_j++;
-                            } else {
-                                break;
-                            }
-                        }
+    // The next move to try, or NULL_MOVE when there are none left
+    move next_move() {
+        while(true) {
+            switch(stage) {
+                case HASH_MOVE_STAGE:
+                    stage = GENERATE_CAPTURES_STAGE;
+                    if(pos.is_pseudo_legal(hash_move) && pos.is_legal(hash_move)) {
+                        return hash_move;
                     }
+                    break;
 
-                    // Straight moves in all 4 directions -> Rooks and Queens
-                    if(is_slider(curr_piece) && curr_piece != WB && curr_piece != BB) {
-                        var_i = i;
-                        var_j = j + 1;
-                        while(is_square_in_range(var_i, var_j)) {
-                            next_piece = board[var_i][var_j];
-                            if(get_piece_side(next_piece) == opposite_side()) {
-                                movelist.push_back(move({i, j}, {var_i, var_j}, next_piece));
-                                break;
-                            } else if(get_piece_side(next_piece) == BLANK) {
-                                movelist.push_back(move({i, j}, {var_i, var_j}));
-                                var_j++;
-                            } else {
-                                break;
-                            }
-                        }
-
-                        var_i = i;
-                        var_j = j - 1;
-                        while(is_square_in_range(var_i, var_j)) {
-                            next_piece = board[var_i][var_j];
-                            if(get_piece_side(next_piece) == opposite_side()) {
-                                movelist.push_back(move({i, j}, {var_i, var_j}, next_piece));
-                                break;
-                            } else if(get_piece_side(next_piece) == BLANK) {
-                                movelist.push_back(move({i, j}, {var_i, var_j}));
-                                var_j--;
-                            } else {
-                                break;
-                            }
-                        }
-                        var_i = i + 1;
-                        var_j = j;
-                        while(is_square_in_range(var_i, var_j)) {
-                            next_piece = board[var_i][var_j];
-                            if(get_piece_side(next_piece) == opposite_side()) {
-                                movelist.push_back(move({i, j}, {var_i, var_j}, next_piece));
-                                break;
-                            } else if(get_piece_side(next_piece) == BLANK) {
-                                movelist.push_back(move({i, j}, {var_i, var_j}));
-                                var_i++;
-                            } else {
-                                break;
-                            }
-                        }
+                case GENERATE_CAPTURES_STAGE:
+                    pos.generate_captures(movelist);
+                    score_captures();
+                    index = 0;
+                    stage = CAPTURES_STAGE;
+                    break;
 
-                        var_i = i - 1;
-                        var_j = j;
-                        while(is_square_in_range(var_i, var_j)) {
-                            next_piece = board[var_i][var_j];
-                            if(get_piece_side(next_piece) == opposite_side()) {
-                                movelist.push_back(move({i, j}, {var_i, var_j}, next_piece));
-                                break;
-                            } else if(get_piece_side(next_piece) == BLANK) {
-                                movelist.push_back(move({i, j}, {var_i, var_j}));
-                                var_i--;
-                            } else {
-                                break;
-                            }
+                case CAPTURES_STAGE:
+                    while(index < movelist.size()) {
+                        move m = pick_best();
+                        if(!(m == hash_move)) {
+                            return m;
                         }
                     }
+                    index = 0;
+                    stage = KILLERS_STAGE;
+                    break;
 
-                    if(curr_piece == WN || curr_piece == BN) {
-                        // The directions in which the knights can move
-                        std::pair<int, int> knight_moves[] = {{1, 2}, {1, -2}, {-1, 2}, {-1, -2},
-                                                              {2, 1}, {2, -1}, {-2, 1}, {-2, -1}};
-
-                        // Generate all knight moves -> capture an opponent piece or just move somewhere.
-                        for(auto next : knight_moves) {
-                            var_i = i + next.first;
-                            var_j = j + next.second;
-                            if(is_square_in_range(var_i, var_j)) {
-                                next_piece = board[var_i][var_j];
-                                if(next_piece == BL) {
-                                    movelist.push_back(move({i, j}, {var_i, var_j}));
-                                } else if(get_piece_side(next_piece) == opposite_side()) {
-                                    movelist.push_back(move({i, j}, {var_i, var_j}, next_piece));
-                                }
-                            }
+                case KILLERS_STAGE:
+                    // Killers are quiet moves which caused a cut off at this depth in a sibling
+                    while(index < 2) {
+                        move m = killers[index++];
+                        bool repeated = (index == 2 && m == killers[0]);
+                        if(!m.is_capture() && !m.is_promotion() && !(m == hash_move) && !repeated
+                           && pos.is_pseudo_legal(m) && pos.is_legal(m)) {
+                            return m;
                         }
                     }
+                    stage = GENERATE_QUIETS_STAGE;
+                    break;
 
-                    if(curr_piece == WP || curr_piece == BP) {
-                        int increment_sign = (side_to_play == WHITE ? -1 : 1);
-
-                        // Move the pawns 1 square ahead
-                        // Note that we have to take care of pawn promotion as well
-                        var_i = i + increment_sign;
-                        var_j = j;
-                        if(is_square_in_range(var_i, var_j)) {
-                            next_piece = board[var_i][var_j];
-                            if(next_piece == BL) {
-                                if(var_i != 7 && var_i != 0 ){
-                                    movelist.push_back(move({i, j}, {var_i, var_j}));
-                                } else {
-                                    movelist.push_back(move({i, j}, {var_i, var_j}, BL, side_to_play == WHITE ? WQ : BQ));
-                                    movelist.push_back(move({i, j}, {var_i, var_j}, BL, side_to_play == WHITE ? WR : BR));
-                                    movelist.push_back(move({i, j}, {var_i, var_j}, BL, side_to_play == WHITE ? WB : BB));
-                                    movelist.push_back(move({i, j}, {var_i, var_j}, BL, side_to_play == WHITE ? WN : BN));
-                                }
-                            }
-                        }
+                case GENERATE_QUIETS_STAGE:
+                    pos.generate_quiets(movelist);
+                    index = 0;
+                    stage = QUIETS_STAGE;
+                    break;
 
-                        // Move the pawns 2 squares ahead if the conditions are satisfied
-                        var_i = i + increment_sign * 2;
-                        var_j = j;
-                        if((i == 6 && curr_piece == WP) || (i == 1 && curr_piece == BP)) {
-                            next_piece = board[var_i][var_j];
-                            if(next_piece == BL) {
-                                movelist.push_back(move({i, j}, {var_i, var_j}));
-                            }
+                case QUIETS_STAGE:
+                    while(index < movelist.size()) {
+                        move m = movelist[index++];
+                        if(!(m == hash_move) && !(m == killers[0]) && !(m == killers[1])) {
+                            return m;
                         }
+                    }
+                    stage = END_STAGE;
+                    break;
 
-                        // Diagonal captures
-                        // Note that we have to take care of pawn promotions as well
-                        var_i = i + increment_sign;
-                        var_j = j + 1;
-                        if(is_square_in_range(var_i, var_j)) {
-                            next_piece = board[var_i][var_j];
-                            if(get_piece_side(next_piece) == opposite_side()) {
-                                if(var_i != 7 && var_i != 0) {
-                                    movelist.push_back(move({i, j}, {var_i, var_j}, next_piece));
-                                } else {
-                                    movelist.push_back(move({i, j}, {var_i, var_j}, next_piece, side_to_play == WHITE ? WQ : BQ));
-                                    movelist.push_back(move({i, j}, {var_i, var_j}, next_piece, side_to_play == WHITE ? WR : BR));
-                                    movelist.push_back(move({i, j}, {var_i, var_j}, next_piece, side_to_play == WHITE ? WB : BB));
-                                    movelist.push_back(move({i, j}, {var_i, var_j}, next_piece, side_to_play == WHITE ? WN : BN));
-                                }
-                            }
-                        }
+                default:
+                    return NULL_MOVE;
+            }
+        }
+    }
+};
 
-                        var_i = i + increment_sign;
-                        var_j = j - 1;
-                        if(is_square_in_range(var_i, var_j)) {
-                            next_piece = board[var_i][var_j];
-                            if(get_piece_side(next_piece) == opposite_side()) {
-                                if(var_i != 7 && var_i != 0) {
-                                    movelist.push_back(move({i, j}, {var_i, var_j}, next_piece));
-                                } else {
-                                    movelist.push_back(move({i, j}, {var_i, var_j}, next_piece, side_to_play == WHITE ? WQ : BQ));
-                                    movelist.push_back(move({i, j}, {var_i, var_j}, next_piece, side_to_play == WHITE ? WR : BR));
-                                    movelist.push_back(move({i, j}, {var_i, var_j}, next_piece, side_to_play == WHITE ? WB : BB));
-                                    movelist.push_back(move({i, j}, {var_i, var_j}, next_piece, side_to_play == WHITE ? WN : BN));
-                                }
-                            }
-                        }
+class chessboard {
+private:
+    position pos;
 
-                        // Enpassant
-                        if(is_square_in_range(var_i, var_j)) {
-                            var_i = i + increment_sign;
-                            var_j = j + 1;
-                            if(is_en_passant_allowed && en_passant_square.first == i && en_passant_square.second == var_j) {
-                                movelist.push_back(move(true, {i, j}, {var_i, var_j}, board[i][var_j]));
-                            }
-
-                            var_i = i + increment_sign;
-                            var_j = j - 1;
-                            if(is_en_passant_allowed && en_passant_square.first == i && en_passant_square.second == var_j) {
-                                movelist.push_back(move(true, {i, j}, {var_i, var_j}, board[i][var_j]));
-                            }
-                        }
+    // One record per move played, so that moves can be taken back to any depth
+    std::vector<undo_record> undo_stack;
+    int undo_count;
 
-                    }
+    // Check squares and discovery candidates for gives_check, valid until the position changes
+    check_info checks;
+    bool checks_valid;
 
-                    if(curr_piece == WK || curr_piece == BK) {
-                        // The directions in which a king can move
-                        std::pair<int, int> king_moves[] = {{0, 1}, {0, -1}, {1, 0}, {-1, 0},
-                                                            {1, 1}, {1, -1}, {-1, 1}, {-1, -1}};
-
-                        // Generate all king moves -> capture an opponent piece or just move somewhere.
-                        for(auto next : king_moves) {
-                            var_i = i + next.first;
-                            var_j = j + next.second;
-                            if(is_square_in_range(var_i, var_j)) {
-                                next_piece = board[var_i][var_j];
-                                if(next_piece == BL) {
-                                    movelist.push_back(move({i, j}, {var_i, var_j}));
-                                } else if(get_piece_side(next_piece) == opposite_side()) {
-                                    movelist.push_back(move({i, j}, {var_i, var_j}, next_piece));
-                                }
-                            }
-                        }
+public:
+    chessboard() : undo_stack(MAX_PLY) {
+        init();
+    }
 
-                    }
+    void init() {
+        pos.init();
+        undo_count = 0;
+        checks_valid = false;
+    }
 
-                }
+    // Set up a position from FEN, with no moves to take back. The board is left as it was if the string is not valid.
+    bool set_fen(const std::string &fen) {
+        position new_pos = pos;
+        if(!new_pos.set_fen(fen)) {
+            return false;
+        }
+        pos = new_pos;
+        undo_count = 0;
+        checks_valid = false;
+        return true;
+    }
+
+    void print() {
+        for(int i = 0; i < 8; i++) {
+            for(int j = 0; j < 8; j++) {
+                std::cout << enum_to_piece[pos.piece_on(square_index(i, j))] << " ";
             }
+            std::cout << std::endl;
         }
 
-        return get_filtered_moves(movelist);
+        std::cout << std::endl;
+        std::cout << "Side to play: " << (pos.side_to_play == WHITE ? "WHITE" : "BLACK") << "\n\n";
     }
     
-    int is_draw_by_insufficient_material() {
-        // Draw by insufficient material:
-        int knight_count = 0;
-        int bishop_count = 0, bishops_on_white = 0, bishops_on_black = 0;
-        int pawn_count = 0;
-        int queen_rook_count = 0;
-        
-        static int const colours[][8] = {
-            {BLACK, WHITE, BLACK, WHITE, BLACK, WHITE, BLACK, WHITE},
-            {WHITE, BLACK, WHITE, BLACK, WHITE, BLACK, WHITE, BLACK},
-            {BLACK, WHITE, BLACK, WHITE, BLACK, WHITE, BLACK, WHITE},
-            {WHITE, BLACK, WHITE, BLACK, WHITE, BLACK, WHITE, BLACK},
-            {BLACK, WHITE, BLACK, WHITE, BLACK, WHITE, BLACK, WHITE},
-            {WHITE, BLACK, WHITE, BLACK, WHITE, BLACK, WHITE, BLACK},
-            {BLACK, WHITE, BLACK, WHITE, BLACK, WHITE, BLACK, WHITE},
-            {WHITE, BLACK, WHITE, BLACK, WHITE, BLACK, WHITE, BLACK}
-        };
+    int get_curr_side() {
+        return pos.side_to_play;
+    }
 
-        for(int i = 0; i < 8; i++) {
-            for(int j = 0; j < 8; j++) {
-                int piece = board[i][j];
-                if(is_knight(piece)) {
-                    knight_count++;
-                } else if(is_bishop(piece)) {
-                    bishop_count++;
-                    if(colours[i][j] == BLACK) {
-                        bishops_on_black++;
-                    } else {
-                        bishops_on_white++;
-                    }
-                } else if(is_pawn(piece)) {
-                    pawn_count++;
-                } else if(is_straight_attacker(piece)) {
-                    queen_rook_count++;
-                }
+    position &get_position() {
+        return pos;
+    }
+
+    uint64_t get_key() {
+        return pos.key;
+    }
+
+    int get_king_square(int side) {
+        return pos.king_square[side];
+    }
+
+    // The undo stack holds the key before every move played, so it doubles as the key history.
+    // Only positions with the same side to play and no capture or pawn move since then can
+    // be repeats, so the scan starts two plies back and stops at the fifty move count.
+    int count_repetitions() {
+        int count = 0;
+        int limit = std::min(int(pos.fifty_move_count), undo_count);
+        for(int back = 2; back <= limit; back += 2) {
+            if(undo_stack[undo_count - back].key == pos.key) {
+                count++;
+            }
+        }
+        return count;
+    }
+
+    // For search: any earlier occurrence is enough to cut the line
+    bool is_repetition() {
+        int limit = std::min(int(pos.fifty_move_count), undo_count);
+        for(int back = 2; back <= limit; back += 2) {
+            if(undo_stack[undo_count - back].key == pos.key) {
+                return true;
             }
         }
+        return false;
+    }
+
+    void make_move(move m) {
+        if(undo_count == int(undo_stack.size())) {
+            undo_stack.resize(2 * undo_stack.size());
+        }
+        pos.make_move(m, undo_stack[undo_count++]);
+        checks_valid = false;
+    }
+
+    void undo_move(move m) {
+        pos.undo_move(m, undo_stack[--undo_count]);
+        checks_valid = false;
+    }
+
+    // Whether a legal move checks the enemy king, without making it.
+    // The first call in a position works out the check squares for all of its moves.
+    bool gives_check(move m) {
+        if(!checks_valid) {
+            checks = pos.get_check_info();
+            checks_valid = true;
+        }
+        return pos.gives_check(m, checks);
+    }
+
+    bool is_square_attacked(int sq, int side) {
+        return pos.is_square_attacked(sq, side);
+    }
+    
+    // Fill the caller's list with all the legal moves in the position
+    void generate_all_moves(move_list &movelist) {
+        pos.generate_all_moves(movelist);
+    }
+
+    void generate_captures(move_list &movelist) {
+        pos.generate_captures(movelist);
+    }
+
+    bool is_pseudo_legal(move m) {
+        return pos.is_pseudo_legal(m);
+    }
+
+    bool is_legal(move m) {
+        return pos.is_legal(m);
+    }
+
+    void generate_quiets(move_list &movelist) {
+        pos.generate_quiets(movelist);
+    }
+
+    int count_legal_moves() {
+        return pos.count_legal_moves();
+    }
+    
+    int is_draw_by_insufficient_material() {
+        // Draw by insufficient material:
+        int knight_count = popcount(pos.pieces(WN) | pos.pieces(BN));
+        bitboard bishops = pos.pieces(WB) | pos.pieces(BB);
+        int bishop_count = popcount(bishops);
+        int bishops_on_black = popcount(bishops & DARK_SQUARES);
+        int bishops_on_white = bishop_count - bishops_on_black;
+        int pawn_count = popcount(pos.pieces(WP) | pos.pieces(BP));
+        int queen_rook_count = popcount(pos.pieces(WQ) | pos.pieces(BQ) | pos.pieces(WR) | pos.pieces(BR));
         
         if(pawn_count + queen_rook_count > 0) {
             return NO_END_OF_GAME;
@@ -958,25 +1840,16 @@ public:
     }
     
     int is_end_of_game() {
-        std::pair<int, int> king_sq = {INVALID, INVALID};
-        int king = INVALID;
-        
-        for(int i = 0; i < 8; i++) {
-            for(int j = 0; j < 8; j++) {
-                if(is_king(board[i][j]) && get_piece_side(board[i][j]) == side_to_play) {
-                    king_sq = {i, j};
-                    king = board[i][j];
-                }
-            }
-        }
+        int king_sq = pos.king_square[pos.side_to_play];
         
-        if(king == INVALID) {
+        if(king_sq == INVALID) {
             std::cout << "INVALID chess position, king not found on board\n\n";
             assert(false);
         } 
         
-        bool is_king_in_check = is_square_attacked(king_sq, opposite_side());
-        std::vector<move> movelist = generate_all_moves();
+        bool is_king_in_check = is_square_attacked(king_sq, pos.opposite_side());
+        move_list movelist;
+        generate_all_moves(movelist);
         
         // See if it's a CHECKMATE or a STALEMATE    
         if(is_king_in_check && movelist.empty()){
@@ -992,8 +1865,13 @@ public:
             return INSUFFICIENT_MATERIAL_DRAW;
         }
         
+        // The same position for the third time
+        if(count_repetitions() >= 2) {
+            return THREE_MOVE_DRAW;
+        }
+        
         // 50 MOVE Rule
-        if(fifty_move_history[fifty_move_history.size()-1] >= 100) {
+        if(pos.fifty_move_count >= 100) {
             return FIFTY_MOVE_DRAW;
         }
         
@@ -1002,22 +1880,43 @@ public:
     }
     
     move parse_move_from_string(std::string move_string, bool &flag) {
-        auto movelist = generate_all_moves();
+        move_list movelist;
+        generate_all_moves(movelist);
         for(move m: movelist) {
-            if(m.get_move_string() == move_string) {
+            // A promotion without a piece letter is a queen promotion, the first one generated
+            if(m.get_move_string() == move_string || m.get_move_string() == move_string + "q") {
                 flag = true;
                 return m;
             }
         }
-        return move({INVALID, INVALID}, {INVALID, INVALID});
+        return NULL_MOVE;
     }
 };
 
+// What to tell the user when the game has ended, side is the side to play in the final position
+std::string end_of_game_message(int game_end_flag, int side) {
+    switch(game_end_flag) {
+        case CHECKMATE:
+            return std::string("Checkmate! ") + (side == BLACK ? "WHITE" : "BLACK") + " wins! Congrats :-)";
+        case STALEMATE:
+            return "Stalemate! The king is not in check and there are no vaild moves!";
+        case INSUFFICIENT_MATERIAL_DRAW:
+            return "Draw due to insufficient material";
+        case THREE_MOVE_DRAW:
+            return "Game drawn. The position has been repeated 3 times.";
+        case FIFTY_MOVE_DRAW:
+            return "Draw by the fifty move rule!";
+        default:
+            return "End of Game Type Unknown! Exiting...";
+    }
+}
+
 // Auxiliary function to print help commands
 void display_help() {
     std::cout << "List of available commands: \n\n";
     std::cout << "help: Display this help.\n";
     std::cout << "print: Print the board.\n";
+    std::cout << "fen: Enter fen <FEN> to set up the position it describes. The move counters may be left out.\n";
     std::cout << "think: Make the computer think for you, i.e. play the current move regardless of user/computer side.\n"
               << "       Also works for a 2 player game. Can be used for hints.\n";
     std::cout << "exit: End the game.\n" ;
@@ -1025,21 +1924,472 @@ void display_help() {
               << "      Can be switched during play.\n";
     std::cout << "side: Enter 'side w' to 'side b' for white/black respectively.\n"
               << "      Can be switched during play.\n";
-    std::cout << "move: Enter move <actual_move> to play the move. Eg. move e2e4/move 0-0";
+    std::cout << "move: Enter move <actual_move> to play the move. Eg. move e2e4/move 0-0\n";
+    std::cout << "bench: Time the move generator on the current position.\n";
+    std::cout << "perft: Enter perft <depth> to count the leaf nodes below the current position.\n";
+    std::cout << "divide: Enter divide <depth> to also count the nodes below every move.\n";
+    std::cout << "perft-full: The same as perft, but every move of the last ply is played instead of counted.\n";
+    std::cout << "threads: Enter threads <n> to run perft on n threads. Defaults to the number of cores.\n";
+    std::cout << "split: Enter split <n> to cut the perft tree into tasks n plies below the root. Defaults to 3.\n"
+              << "       It is at most depth - 2, so each task keeps two plies.\n";
+    std::cout << "hash: Enter hash <MB> to keep perft subtree counts in a table of that size, hash 0 to stop. Off by default.\n";
+    std::cout << "perft-suite: Enter perft-suite <file.epd> <max depth> to check the ;D<depth> <nodes> counts of every\n"
+              << "             position in the file, up to the optional depth limit. Eg. perft-suite perft_suite.epd\n"
+              << "             checks the reference positions which come with the engine.";
+}
+
+// Count the leaf nodes of the game tree below a position, making each child
+// by playing the move and then taking it back.
+// With bulk counting the last ply is not played, its nodes are the legal moves of its parent.
+long long count_nodes_make_unmake(position &pos, int depth, bool bulk = false) {
+    if(depth == 0) {
+        return 1;
+    }
+    if(bulk && depth == 1) {
+        return pos.count_legal_moves();
+    }
+    move_list movelist;
+    pos.generate_all_moves(movelist);
+
+    long long nodes = 0;
+    undo_record undo;
+    for(move m: movelist) {
+        pos.make_move(m, undo);
+        nodes += count_nodes_make_unmake(pos, depth - 1, bulk);
+        pos.undo_move(m, undo);
+    }
+    return nodes;
+}
+
+// The same walk, making each child as a copy of its parent with the move played on it
+long long count_nodes_copy_make(position &pos, int depth, bool bulk = false) {
+    if(depth == 0) {
+        return 1;
+    }
+    if(bulk && depth == 1) {
+        return pos.count_legal_moves();
+    }
+    move_list movelist;
+    pos.generate_all_moves(movelist);
+
+    long long nodes = 0;
+    undo_record undo;
+    for(move m: movelist) {
+        position child = pos;
+        child.make_move(m, undo);
+        nodes += count_nodes_copy_make(child, depth - 1, bulk);
+    }
+    return nodes;
+}
+
+// The same walk with the moves handed out stage by stage by a move_picker
+long long count_nodes_move_picker(position &pos, int depth) {
+    if(depth == 0) {
+        return 1;
+    }
+    move_picker picker(pos, NULL_MOVE, NULL_MOVE, NULL_MOVE);
+
+    long long nodes = 0;
+    undo_record undo;
+    for(move m = picker.next_move(); !(m == NULL_MOVE); m = picker.next_move()) {
+        pos.make_move(m, undo);
+        nodes += count_nodes_move_picker(pos, depth - 1);
+        pos.undo_move(m, undo);
+    }
+    return nodes;
+}
+
+// Auxiliary function to measure the speed of the move generator
+void bench(chessboard &board) {
+    const int iterations = 100000;
+    long long move_count = 0;
+    move_list movelist;
+
+    auto start = std::chrono::steady_clock::now();
+    for(int n = 0; n < iterations; n++) {
+        board.generate_all_moves(movelist);
+        move_count += movelist.size();
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    std::cout << "Slider attacks: " << slider_backend_name() << "\n";
+    std::cout << "Position updates: " << POSITION_UPDATE_NAME << "\n";
+    std::cout << "Board layout: " << BOARD_LAYOUT_NAME << "\n";
+    std::cout << "Generated " << move_count << " moves in " << seconds << " seconds ("
+              << (long long)(iterations / seconds) << " positions per second)\n";
+
+    // What a quiescence search would ask for
+    move_count = 0;
+    start = std::chrono::steady_clock::now();
+    for(int n = 0; n < iterations; n++) {
+        board.generate_captures(movelist);
+        move_count += movelist.size();
+    }
+    seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cout << "Generated " << move_count << " captures in " << seconds << " seconds ("
+              << (long long)(iterations / seconds) << " positions per second)\n";
+
+    // Walk the same tree with both ways of making child positions, and with the move picker
+    const int depth = 4;
+    std::string scheme_names[] = {"make/unmake", "copy-make", "the move picker"};
+    for(int scheme = 0; scheme < 3; scheme++) {
+        position pos = board.get_position();
+        start = std::chrono::steady_clock::now();
+        long long nodes;
+        if(scheme == 0) {
+            nodes = count_nodes_make_unmake(pos, depth);
+        } else if(scheme == 1) {
+            nodes = count_nodes_copy_make(pos, depth);
+        } else {
+            nodes = count_nodes_move_picker(pos, depth);
+        }
+        seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        std::cout << "Tree walk to depth " << depth << " with " << scheme_names[scheme] << ": " << nodes
+                  << " nodes in " << seconds << " seconds (" << (long long)(nodes / seconds) << " nodes per second)\n";
+    }
+}
+
+// Largest perft hash the hash command accepts, 1 TB
+#define MAX_PERFT_HASH_MB (1 << 20)
+
+// Subtree counts for perft, keyed by position and depth, shared by all perft threads without
+// a lock. An entry is two separate words, the data and the data XOR the key, so an entry torn
+// by two threads writing at once fails the key check and reads as a miss, never as a wrong count.
+class perft_cache {
+private:
+    struct entry {
+        std::atomic<uint64_t> check;
+        std::atomic<uint64_t> data;     // Node count above the low 8 bits, depth in them
+    };
+
+    std::unique_ptr<entry[]> entries;
+    uint64_t mask = 0;
+
+public:
+    // A power of two number of entries in at most the given size, none for 0.
+    // Returns false and keeps the old table if the memory cannot be had.
+    bool resize(int megabytes) {
+        uint64_t count = std::bit_floor(uint64_t(megabytes) * 1024 * 1024 / sizeof(entry));
+        if(count == 0) {
+            entries.reset();
+            mask = 0;
+            return true;
+        }
+        entry *table = new (std::nothrow) entry[count]();
+        if(table == nullptr) {
+            return false;
+        }
+        entries.reset(table);
+        mask = count - 1;
+        return true;
+    }
+
+    bool enabled() const {
+        return entries != nullptr;
+    }
+
+    bool probe(uint64_t key, int depth, long long &nodes) const {
+        const entry &e = entries[key & mask];
+        uint64_t data = e.data.load(std::memory_order_relaxed);
+        uint64_t check = e.check.load(std::memory_order_relaxed);
+        if((check ^ data) != key || int(data & 0xFF) != depth) {
+            return false;
+        }
+        nodes = (long long)(data >> 8);
+        return true;
+    }
+
+    // Always replace, the newest subtree is the most likely to be met again
+    void store(uint64_t key, int depth, long long nodes) {
+        entry &e = entries[key & mask];
+        uint64_t data = (uint64_t(nodes) << 8) | uint64_t(depth);
+        e.data.store(data, std::memory_order_relaxed);
+        e.check.store(key ^ data, std::memory_order_relaxed);
+    }
+};
+
+// The tree walk with subtree counts looked up in and added to the cache. The leaves are
+// cheap to count again, so only subtrees of two plies or more are kept.
+long long count_nodes_hashed(position &pos, int depth, bool bulk, perft_cache &cache) {
+    if(depth == 0) {
+        return 1;
+    }
+    if(bulk && depth == 1) {
+        return pos.count_legal_moves();
+    }
+    long long nodes = 0;
+    if(depth >= 2 && cache.probe(pos.key, depth, nodes)) {
+        return nodes;
+    }
+
+    move_list movelist;
+    pos.generate_all_moves(movelist);
+    undo_record undo;
+    for(move m: movelist) {
+#ifdef COPY_MAKE
+        position child = pos;
+        child.make_move(m, undo);
+        nodes += count_nodes_hashed(child, depth - 1, bulk, cache);
+#else
+        pos.make_move(m, undo);
+        nodes += count_nodes_hashed(pos, depth - 1, bulk, cache);
+        pos.undo_move(m, undo);
+#endif
+    }
+    if(depth >= 2) {
+        cache.store(pos.key, depth, nodes);
+    }
+    return nodes;
+}
+
+// The tree walk for the position updates the engine was built with, through the cache if there is one
+long long count_nodes(position &pos, int depth, bool bulk, perft_cache *cache) {
+    if(cache != nullptr) {
+        return count_nodes_hashed(pos, depth, bulk, *cache);
+    }
+#ifdef COPY_MAKE
+    return count_nodes_copy_make(pos, depth, bulk);
+#else
+    return count_nodes_make_unmake(pos, depth, bulk);
+#endif
+}
+
+// A subtree for parallel perft, below the first few plies from the root.
+// The position is its own copy, so threads never share a board.
+struct perft_task {
+    position pos;
+    int depth;
+    int root_move;
+    long long nodes;
+    double seconds;
+};
+
+// Walk split more plies below pos and add a task for every position reached
+void split_perft_tasks(position &pos, int depth, int split, int root_move, std::vector<perft_task> &tasks) {
+    if(split == 0) {
+        tasks.push_back({pos, depth, root_move, 0, 0});
+        return;
+    }
+    move_list movelist;
+    pos.generate_all_moves(movelist);
+    for(move m: movelist) {
+        position child = pos;
+        undo_record undo;
+        child.make_move(m, undo);
+        split_perft_tasks(child, depth - 1, split - 1, root_move, tasks);
+    }
+}
+
+// Runs perft tasks on a fixed number of threads. Each thread is dealt a block of
+// neighbouring tasks and works through it from the back. A thread which runs out steals
+// from the front of the other queues, so the threads finish at about the same time
+// however uneven the subtrees are. Every task keeps its own count, which makes the
+// total the same whichever thread ran it.
+class perft_pool {
+private:
+    struct task_queue {
+        std::mutex lock;
+        std::deque<int> tasks;
+    };
+
+    std::vector<perft_task> &tasks;
+    std::vector<task_queue> queues;
+    bool bulk;
+    perft_cache *cache;
+
+    bool take_task(int thread, int &task) {
+        {
+            std::lock_guard<std::mutex> guard(queues[thread].lock);
+            if(!queues[thread].tasks.empty()) {
+                task = queues[thread].tasks.back();
+                queues[thread].tasks.pop_back();
+                return true;
+            }
+        }
+        for(int offset = 1; offset < int(queues.size()); offset++) {
+            task_queue &victim = queues[(thread + offset) % queues.size()];
+            std::lock_guard<std::mutex> guard(victim.lock);
+            if(!victim.tasks.empty()) {
+                task = victim.tasks.front();
+                victim.tasks.pop_front();
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // No task makes new ones, so once every queue is empty the work is done
+    void work(int thread) {
+        int task;
+        while(take_task(thread, task)) {
+            auto start = std::chrono::steady_clock::now();
+            tasks[task].nodes = count_nodes(tasks[task].pos, tasks[task].depth, bulk, cache);
+            tasks[task].seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        }
+    }
+
+public:
+    perft_pool(std::vector<perft_task> &task_list, int threads, bool bulk_count, perft_cache *shared_cache)
+        : tasks(task_list), queues(threads), bulk(bulk_count), cache(shared_cache) {
+        for(int task = 0; task < int(tasks.size()); task++) {
+            queues[(long long)task * threads / tasks.size()].tasks.push_back(task);
+        }
+    }
+
+    void run() {
+        std::vector<std::thread> workers;
+        for(int thread = 0; thread < int(queues.size()); thread++) {
+            workers.emplace_back(&perft_pool::work, this, thread);
+        }
+        for(std::thread &worker: workers) {
+            worker.join();
+        }
+    }
+};
+
+// Count the leaf nodes below the current position, with divide also the nodes below each move.
+// The leaves are bulk counted unless every last move is to be played.
+// With more than one thread the tree is cut into tasks split_depth plies below the root.
+// With a cache, subtree counts are kept in it, and stay valid for later runs.
+void perft(chessboard &board, int depth, bool divide, bool bulk, int threads, int split_depth, perft_cache *cache) {
+    position pos = board.get_position();
+    move_list movelist;
+    pos.generate_all_moves(movelist);
+    long long move_nodes[MAX_MOVES] = {};
+
+    auto start = std::chrono::steady_clock::now();
+    if(threads <= 1) {
+        for(int i = 0; i < movelist.size(); i++) {
+            position child = pos;
+            undo_record undo;
+            child.make_move(movelist[i], undo);
+            move_nodes[i] = count_nodes(child, depth - 1, bulk, cache);
+        }
+    } else {
+        std::vector<perft_task> tasks;
+        // Each task keeps at least two plies, a task per leaf spends its time on the deques
+        int split = std::clamp(split_depth, 1, std::max(depth - 2, 1)) - 1;
+        for(int i = 0; i < movelist.size(); i++) {
+            position child = pos;
+            undo_record undo;
+            child.make_move(movelist[i], undo);
+            split_perft_tasks(child, depth - 1, split, i, tasks);
+        }
+        perft_pool(tasks, threads, bulk, cache).run();
+        for(const perft_task &task: tasks) {
+            move_nodes[task.root_move] += task.nodes;
+        }
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    long long nodes = 0;
+    for(int i = 0; i < movelist.size(); i++) {
+        if(divide) {
+            std::cout << movelist[i].get_move_string() << ": " << move_nodes[i] << "\n";
+        }
+        nodes += move_nodes[i];
+    }
+
+    std::cout << "\nNodes: " << nodes << "\n";
+    std::cout << "Time: " << seconds << " seconds on " << std::max(threads, 1) << " thread(s)\n";
+    std::cout << "Nodes per second: " << (long long)(nodes / std::max(seconds, 1e-9)) << "\n\n";
+}
+
+// Check the counts of every position in an EPD file, given after the FEN as ";D1 20 ;D2 400 ...",
+// up to max_depth. Each count is a task for the perft thread pool, so positions run in parallel.
+void perft_suite(const std::string &file_name, int max_depth, int threads, perft_cache *cache) {
+    std::ifstream file(file_name);
+    if(!file) {
+        std::cout << "Could not open " << file_name << "\n\n";
+        return;
+    }
+
+    std::vector<std::string> fens;
+    std::vector<perft_task> tasks;
+    std::vector<long long> expected;
+    std::string line;
+    while(std::getline(file, line)) {
+        size_t counts_start = line.find(';');
+        std::string fen = line.substr(0, counts_start);
+        fen.erase(fen.find_last_not_of(" \t\r") + 1);
+        position pos;
+        if(fen.empty()) {
+            continue;
+        }
+        if(!pos.set_fen(fen)) {
+            std::cout << "Skipping a line which is not a valid position: " << line << "\n";
+            continue;
+        }
+
+        std::istringstream counts(counts_start == std::string::npos ? "" : line.substr(counts_start));
+        std::string field;
+        long long nodes;
+        while(counts >> field >> nodes) {
+            if(field.size() <= 2 || field.rfind(";D", 0) != 0) {
+                continue;
+            }
+            int depth = std::atoi(field.c_str() + 2);
+            if(depth >= 1 && depth <= max_depth) {
+                tasks.push_back({pos, depth, int(fens.size()), 0, 0});
+                expected.push_back(nodes);
+            }
+        }
+        fens.push_back(fen);
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    perft_pool(tasks, threads, true, cache).run();
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    // The tasks of a position are next to each other, in the order of the file
+    int mismatches = 0;
+    long long total_nodes = 0;
+    size_t task = 0;
+    for(int index = 0; index < int(fens.size()); index++) {
+        std::cout << "Position " << index + 1 << ": " << fens[index] << "\n";
+        if(task == tasks.size() || tasks[task].root_move != index) {
+            std::cout << "  No count checked, all are deeper than the depth limit\n";
+            continue;
+        }
+        long long nodes = 0;
+        double position_seconds = 0;
+        for(; task < tasks.size() && tasks[task].root_move == index; task++) {
+            std::cout << "  D" << tasks[task].depth << ": " << tasks[task].nodes;
+            if(tasks[task].nodes == expected[task]) {
+                std::cout << " OK";
+            } else {
+                std::cout << " MISMATCH, expected " << expected[task];
+                mismatches++;
+            }
+            std::cout << "\n";
+            nodes += tasks[task].nodes;
+            position_seconds += tasks[task].seconds;
+        }
+        std::cout << "  Nodes per second: " << (long long)(nodes / std::max(position_seconds, 1e-9)) << "\n";
+        total_nodes += nodes;
+    }
+
+    std::cout << "\nPositions: " << fens.size() << ", counts checked: " << tasks.size()
+              << ", mismatches: " << mismatches << "\n";
+    std::cout << "Time: " << seconds << " seconds on " << threads << " thread(s)\n";
+    std::cout << "Nodes per second: " << (long long)(total_nodes / std::max(seconds, 1e-9)) << "\n\n";
 }
 
 int main() {
-    populate_square_move_maps();
+    init_slider_attacks();
     
     chessboard board;
     std::string input;
     std::string message;
-    int game_end_flag;
-    bool think;
+    int game_end_flag = NO_END_OF_GAME;
+    bool think = false;
 
     // Defaults
     bool computer_brain = false;
     int user_side = WHITE;
+    int perft_threads = std::max(1, int(std::thread::hardware_concurrency()));
+    int perft_split_depth = 3;
+    perft_cache perft_hash;
 
     // Output commands and their usage
     display_help();
@@ -1064,6 +2414,94 @@ int main() {
             board.print();
         }
 
+        else if(input == "fen") {
+            // The FEN fields are the rest of the line
+            std::getline(std::cin, input);
+            if(board.set_fen(input)) {
+                // A position which is already over is reported but, unlike at the end of a
+                // game, the REPL keeps going so it can still be counted with perft or divide
+                int result = board.is_end_of_game();
+                board.print();
+                message = "Position set up\n\n";
+                if(result != NO_END_OF_GAME) {
+                    message = "Position set up. " + end_of_game_message(result, board.get_curr_side()) + "\n\n";
+                }
+            } else {
+                message = "Invalid FEN! Existing position not changed!\n\n";
+            }
+        }
+
+        else if(input == "bench") {
+            message = "";
+            bench(board);
+        }
+
+        else if(input == "perft-suite") {
+            // The file name and an optional depth limit, on the rest of the line
+            std::getline(std::cin, input);
+            std::istringstream arguments(input);
+            std::string file_name;
+            int max_depth = 64;
+            arguments >> file_name >> max_depth;
+            if(!file_name.empty() && max_depth >= 1) {
+                message = "";
+                perft_suite(file_name, max_depth, perft_threads, perft_hash.enabled() ? &perft_hash : nullptr);
+            } else {
+                message = "Please enter perft-suite <file.epd> with an optional depth limit!\n\n";
+            }
+        }
+
+        else if(input == "perft" || input == "divide" || input == "perft-full") {
+            bool divide = (input == "divide");
+            bool bulk = (input != "perft-full");
+            std::cin >> input;
+            int depth = std::atoi(input.c_str());
+            if(depth >= 1) {
+                message = "";
+                perft(board, depth, divide, bulk, perft_threads, perft_split_depth,
+                      perft_hash.enabled() ? &perft_hash : nullptr);
+            } else {
+                message = "Invalid depth! Please enter a depth of 1 or more!\n\n";
+            }
+        }
+
+        else if(input == "threads") {
+            std::cin >> input;
+            int threads = std::atoi(input.c_str());
+            if(threads >= 1) {
+                perft_threads = threads;
+                message = "Perft will run on " + std::to_string(threads) + " thread(s)\n";
+            } else {
+                message = "Invalid number of threads! Existing setting not changed!\n";
+            }
+        }
+
+        else if(input == "hash") {
+            std::cin >> input;
+            // strtoll stops at LLONG_MAX instead of overflowing like atoi
+            long long megabytes = std::strtoll(input.c_str(), nullptr, 10);
+            if(input.empty() || input.find_first_not_of("0123456789") != std::string::npos || megabytes > MAX_PERFT_HASH_MB) {
+                message = "Invalid hash size! Please enter 0 to " + std::to_string(MAX_PERFT_HASH_MB) + " MB. Existing setting not changed!\n";
+            } else if(!perft_hash.resize(int(megabytes))) {
+                message = "Could not allocate " + input + " MB for the perft hash! Existing setting not changed!\n";
+            } else if(megabytes > 0) {
+                message = "Perft will keep subtree counts in " + input + " MB\n";
+            } else {
+                message = "Perft will not keep subtree counts\n";
+            }
+        }
+
+        else if(input == "split") {
+            std::cin >> input;
+            int split_depth = std::atoi(input.c_str());
+            if(split_depth >= 1) {
+                perft_split_depth = split_depth;
+                message = "Parallel perft will split the tree " + std::to_string(split_depth) + " plies below the root\n";
+            } else {
+                message = "Invalid split depth! Existing setting not changed!\n";
+            }
+        }
+
         else if(input == "think") {
             message = "";
             think = true;
@@ -1119,43 +2557,21 @@ int main() {
             message = "Unknown input! Type 'help' to view the list of available commands!\n\n";
         }
         
-        if((computer_brain && user_side != board.get_curr_side()) || think) {
-            auto movelist = board.generate_all_moves();
+        // A position set up with fen may already be over, with no move to play
+        if(((computer_brain && user_side != board.get_curr_side()) || think) && board.is_end_of_game() == NO_END_OF_GAME) {
+            move_list movelist;
+            board.generate_all_moves(movelist);
             // The current logic is to choose a random index.
             // We will implement an AI later.
             board.make_move(movelist[rand() % movelist.size()]);
             game_end_flag = board.is_end_of_game();
             board.print();
             message = "Played " + movelist[0].get_move_string() + "\n\n";
-            think = false;
         }
+        think = false;
         
-        switch(game_end_flag) {
-            case NO_END_OF_GAME:
-                break;
-            case CHECKMATE:
-                message = "Checkmate! ";
-                if(board.get_curr_side() == BLACK) {
-                    message += "WHITE";
-                } else {
-                    message += "BLACK";
-                }
-                message += " wins! Congrats :-)";
-                break;
-            case STALEMATE:
-                message = "Stalemate! The king is not in check and there are no vaild moves!";
-                break;
-            case INSUFFICIENT_MATERIAL_DRAW:
-                message = "Draw due to insufficient material";
-                break;
-            case THREE_MOVE_DRAW:
-                message = "Game drawn. The position has been repeated 3 times.";
-                break;
-            case FIFTY_MOVE_DRAW:
-                message = "Draw by the fifty move rule!";
-                break;
-            default:
-                message = "End of Game Type Unknown! Exiting...";
+        if(game_end_flag != NO_END_OF_GAME) {
+            message = end_of_game_message(game_end_flag, board.get_curr_side());
         }
 
         std::cout << message << std::endl;